@@ -18,13 +18,41 @@
 
 #include "bstree.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #define MAX(a,b) (((a) > (b)) ? (a) : (b))
 
 #define MAX_IMBALANCE 1
 
+/* Flags for insert_, telling whether we are still on the leftmost or the
+ * rightmost path of the tree.
+ */
+#define EDGE_MIN 1
+#define EDGE_MAX 2
+
+/* Number of objects a small tree keeps inside itself, before making nodes
+ * for them, see struct bstree_small.
+ */
+#define SMALL_CAPACITY 4
+
+/* Number of objects a node of the fat engine can hold. 16 pointers make up
+ * two cache lines.
+ */
+#define FAT_CAPACITY 16
+
 struct bstree_node {
     void *object;
     struct bstree_node *left;
@@ -33,6 +61,33 @@ struct bstree_node {
     int height;
 };
 
+/* A node of the fat engine holds a sorted run of objects. Every object in
+ * the left subtree is less than objects[0] and every object in the right
+ * subtree is greater than objects[n - 1]. Balancing is done over the fat
+ * nodes, exactly as it is done over the binary nodes.
+ */
+struct bstree_fat_node {
+    struct bstree_fat_node *left;
+    struct bstree_fat_node *right;
+    int n;
+    int height;
+    void *objects[FAT_CAPACITY];
+    int counts[FAT_CAPACITY];
+};
+
+enum bstree_engine {
+    ENGINE_BINARY,
+    ENGINE_FAT
+};
+
+/* How the binary engine keeps its balance. Under the weak AVL policy,
+ * 'height' of a node holds its rank instead, see wavl_fix_insert_.
+ */
+enum bstree_policy {
+    POLICY_AVL,
+    POLICY_WAVL
+};
+
 struct bstree_ops {
     int (*compare_object)(const void *lhs, const void *rhs);
     /* If the user supplies a function to free the objects, then we know that
@@ -42,11 +97,100 @@ struct bstree_ops {
      * objects and never free them, that means the user manages the lifetime.
      */
     void (*free_object)(void *object);
+    /* Only given for trees with a hash index */
+    unsigned long (*hash_object)(const void *object);
+    enum bstree_engine engine;
+    enum bstree_policy policy;
+    /* Only given for augmented trees, see bstree_new_augmented. The
+     * aggregate of a node is stored right after it.
+     */
+    size_t agg_size;
+    void (*leaf)(void *agg, const void *object, int count);
+    void (*combine)(void *agg, const void *lhs, const void *rhs);
+    /* Only given for string trees, see bstree_new_str */
+    const char *(*key)(const void *object);
+    /* Trees with the same functions share their ops, see ops_get_ */
+    int refs;
+    struct bstree_ops *next;
+};
+
+/* The start of the key of a string tree, kept right after each node. The
+ * first 8 bytes of the string are packed big-endian and padded with zeros,
+ * so that comparing prefixes as integers orders them like strcmp would.
+ */
+struct bstree_str_key {
+    uint64_t prefix;
+    size_t len;
+};
+
+/* What string trees search for. The functions walking the tree are given
+ * a pointer to one of these as the key, instead of the object.
+ */
+struct bstree_str_probe {
+    struct bstree_str_key key;
+    const char *str;
+};
+
+struct bstree_index_slot {
+    unsigned long hash;
+    struct bstree_node *node;
+};
+
+struct bstree_index {
+    struct bstree_index_slot *slots;
+    /* There are 2^bits slots */
+    int bits;
+    size_t used;
+};
+
+/* Room for nodes laid out in order by bstree_compact. Slots freed later on
+ * are kept on a free list of the tree, linked through 'left', and are used
+ * again before anything new is allocated.
+ */
+struct bstree_slab {
+    size_t n;
+    /* Bytes taken by each node, see node_size_ */
+    size_t stride;
+    struct bstree_node nodes[];
+};
+
+/* The objects of a small tree, in order, with their counts. Plain binary
+ * trees start out small, most of them never get any bigger, and they get
+ * nodes only once they are about to hold more than SMALL_CAPACITY objects.
+ */
+struct bstree_small {
+    void *objects[SMALL_CAPACITY];
+    int counts[SMALL_CAPACITY];
 };
 
 struct bstree {
-    struct bstree_node *root;
     struct bstree_ops *ops;
+    union {
+        /* While the tree is small */
+        struct bstree_small array;
+        struct {
+            union {
+                struct bstree_node *root;
+                struct bstree_fat_node *fat_root;
+            };
+            /* Fingers on the least and the greatest nodes, kept by the
+             * binary engine only.
+             */
+            struct bstree_node *min;
+            struct bstree_node *max;
+            struct bstree_slab *slab;
+            struct bstree_node *free_nodes;
+        };
+    };
+    struct bstree_index *index;
+    struct bstree_wal *wal;
+    /* Number of nodes (or objects in the array of a small tree), kept by
+     * the binary engine only.
+     */
+    int size;
+    /* Most nodes a bounded tree may have, 0 for the other trees */
+    int capacity;
+    int small;
 };
 
 /* Internal helper functions
@@ -57,16 +201,98 @@ static int int_max_(int a, int b)
     return a > b ? a : b;
 }
 
+static int int_min_(int a, int b)
+{
+    return a < b ? a : b;
+}
+
 static int height_(struct bstree_node *root)
 {
     return root ? root->height : -1;
 }
 
+/* Bytes to allocate for a node of the tree, with room for the aggregate
+ * of augmented trees. Keeps the aggregates aligned as malloc would.
+ */
+static size_t node_size_(const struct bstree_ops *ops)
+{
+    size_t align = _Alignof(max_align_t);
+    size_t extra = ops->key ? sizeof(struct bstree_str_key) : ops->agg_size;
+    return sizeof(struct bstree_node) + (extra + align - 1) / align * align;
+}
+
+/* The aggregate of the subtree of an augmented tree.
+ */
+static void *agg_(const struct bstree_node *node)
+{
+    return (void *)(node + 1);
+}
+
+static struct bstree_str_key *str_key_(const struct bstree_node *node)
+{
+    return (struct bstree_str_key *)(node + 1);
+}
+
+/* Make the key to search a string tree for the given object, or just
+ * return the object for the other trees.
+ */
+static const void *probe_(const struct bstree_ops *ops, const void *object,
+        struct bstree_str_probe *probe)
+{
+    const unsigned char *str;
+    size_t i;
+    if (!ops->key) {
+        return object;
+    }
+    probe->str = ops->key(object);
+    probe->key.len = strlen(probe->str);
+    probe->key.prefix = 0;
+    str = (const unsigned char *)probe->str;
+    for (i = 0; i < sizeof probe->key.prefix; i++) {
+        probe->key.prefix <<= 8;
+        if (i < probe->key.len) {
+            probe->key.prefix |= str[i];
+        }
+    }
+    return probe;
+}
+
+/* Compare the key, as made by probe_, with the object of the node. Keys of
+ * string trees only look at the string when the prefixes are the same,
+ * and then only past the prefix. Strings shorter than the prefix are
+ * equal if their prefixes are.
+ */
+static int compare_(const struct bstree_ops *ops, const void *key,
+        const struct bstree_node *node)
+{
+    const struct bstree_str_probe *probe = key;
+    const struct bstree_str_key *cached;
+    size_t n;
+    int cmp;
+    if (!ops->key) {
+        return ops->compare_object(key, node->object);
+    }
+    cached = str_key_(node);
+    if (probe->key.prefix != cached->prefix) {
+        return probe->key.prefix < cached->prefix ? -1 : 1;
+    }
+    n = probe->key.len < cached->len ? probe->key.len : cached->len;
+    if (n > sizeof cached->prefix) {
+        n -= sizeof cached->prefix;
+        cmp = memcmp(probe->str + sizeof cached->prefix,
+                ops->key(node->object) + sizeof cached->prefix, n);
+        if (cmp) {
+            return cmp;
+        }
+    }
+    return (probe->key.len > cached->len) - (probe->key.len < cached->len);
+}
+
 /* Make a node that is a valid tree consisting of one node, only the root.
  */
-static struct bstree_node *mknode_(void *object)
+static struct bstree_node *mknode_(void *object, size_t size)
 {
-    struct bstree_node *root = malloc(sizeof *root);
+    struct bstree_node *root = malloc(size);
     root->object = object;
     root->left = NULL;
     root->right = NULL;
@@ -116,6 +342,8 @@ static struct bstree_node *double_with_right_(struct bstree_node *root)
  * tree exists. Therefore, a valid tree generated by us will either be balanced,
  * or imbalanced by 2 because of a recent insertion (or deletion).
  * If the latter is the case, this function restores the balance.
+ * After a deletion, the children of the taller child may be of equal
+ * height, a single rotation is the one that fixes that case.
  */
 static struct bstree_node *balance_(struct bstree_node *root)
 {
@@ -123,13 +351,13 @@ static struct bstree_node *balance_(struct bstree_node *root)
         return NULL;
     }
     if (height_(root->left) - height_(root->right) > MAX_IMBALANCE) {
-        if (height_(root->left->left) > height_(root->left->right)) {
+        if (height_(root->left->left) >= height_(root->left->right)) {
             root = rotate_with_left_(root);
         } else {
             root = double_with_left_(root);
         }
     } else if (height_(root->right) - height_(root->left) > MAX_IMBALANCE) {
-        if (height_(root->right->right) > height_(root->right->left)) {
+        if (height_(root->right->right) >= height_(root->right->left)) {
             root = rotate_with_right_(root);
         } else {
             root = double_with_right_(root);
@@ -139,6 +367,381 @@ static struct bstree_node *balance_(struct bstree_node *root)
     return root;
 }
 
+/* Weak AVL (rank-balanced) trees, as described by Haeupler, Sen and Tarjan.
+ * Every node has a rank, a missing node has rank -1. The rank difference of
+ * a child is the rank of its parent minus its own, and it must be 1 or 2.
+ * A leaf must have rank 0. Only insertions build the tree, the rank is
+ * the same as the height and the tree is an AVL tree. Deletions are allowed
+ * to leave 2,2 nodes behind, and that spares us most of the rotations.
+ * The height of the tree is at most 2 log n, rotations are O(1) amortized.
+ */
+
+/* Fix the node after an insertion into one of its subtrees. If a child
+ * got the same rank as the node, either promote the node, pushing the
+ * problem up, or rotate and be done with it.
+ */
+static struct bstree_node *wavl_fix_insert_(struct bstree_node *root)
+{
+    struct bstree_node *child;
+    int rank = root->height;
+    if (height_(root->left) == rank) {
+        if (rank - height_(root->right) == 1) {
+            root->height++;
+            return root;
+        }
+        child = root->left;
+        if (child->height - height_(child->right) == 2) {
+            root = rotate_with_left_(root);
+            root->right->height = rank - 1;
+            root->height = rank;
+        } else {
+            root = double_with_left_(root);
+            root->left->height = rank - 1;
+            root->right->height = rank - 1;
+            root->height = rank;
+        }
+    } else if (height_(root->right) == rank) {
+        if (rank - height_(root->left) == 1) {
+            root->height++;
+            return root;
+        }
+        child = root->right;
+        if (child->height - height_(child->left) == 2) {
+            root = rotate_with_right_(root);
+            root->left->height = rank - 1;
+            root->height = rank;
+        } else {
+            root = double_with_right_(root);
+            root->left->height = rank - 1;
+            root->right->height = rank - 1;
+            root->height = rank;
+        }
+    }
+    return root;
+}
+
+/* Fix the node after a deletion from one of its subtrees. That may have
+ * left the node as a 2,2 leaf, or with a child of rank difference 3.
+ */
+static struct bstree_node *wavl_fix_remove_(struct bstree_node *root)
+{
+    struct bstree_node *sibling, *outer;
+    int rank = root->height;
+    int left_short = rank - height_(root->left) == 3;
+    if (!root->left && !root->right) {
+        root->height = 0;
+        return root;
+    }
+    if (!left_short && rank - height_(root->right) != 3) {
+        return root;
+    }
+    sibling = left_short ? root->right : root->left;
+    if (rank - sibling->height == 2) {
+        root->height--;
+        return root;
+    }
+    if (sibling->height - height_(sibling->left) == 2 &&
+            sibling->height - height_(sibling->right) == 2) {
+        sibling->height--;
+        root->height--;
+        return root;
+    }
+    outer = left_short ? sibling->right : sibling->left;
+    if (sibling->height - height_(outer) == 1) {
+        struct bstree_node *demoted = root;
+        root = left_short ? rotate_with_right_(root)
+            : rotate_with_left_(root);
+        root->height = rank;
+        demoted->height = rank - 1;
+        if (!demoted->left && !demoted->right) {
+            demoted->height = 0;
+        }
+    } else {
+        root = left_short ? double_with_right_(root)
+            : double_with_left_(root);
+        root->height = rank;
+        root->left->height = rank - 2;
+        root->right->height = rank - 2;
+    }
+    return root;
+}
+
+/* Recompute the aggregate of the node from its object and its children,
+ * in order. Does nothing unless the tree is augmented.
+ */
+static void update_(const struct bstree_ops *ops, struct bstree_node *node)
+{
+    void *agg;
+    if (!ops->combine || !node) {
+        return;
+    }
+    agg = agg_(node);
+    ops->leaf(agg, node->object, node->count);
+    if (node->left) {
+        ops->combine(agg, agg_(node->left), agg);
+    }
+    if (node->right) {
+        ops->combine(agg, agg, agg_(node->right));
+    }
+}
+
+/* Bring the aggregates up to date after fixing the balance at 'old',
+ * which gave 'root'. If there was a rotation, the nodes it moved are
+ * children of the new root.
+ */
+static struct bstree_node *augment_(const struct bstree_ops *ops,
+        struct bstree_node *old, struct bstree_node *root)
+{
+    if (!ops->combine || !root) {
+        return root;
+    }
+    if (root != old) {
+        update_(ops, root->left);
+        update_(ops, root->right);
+    }
+    update_(ops, root);
+    return root;
+}
+
+/* Update the aggregates along the spine down to the least (greatest) node,
+ * after its count changed.
+ */
+static void update_spine_(const struct bstree_ops *ops,
+        struct bstree_node *root, int max)
+{
+    if (!ops->combine || !root) {
+        return;
+    }
+    update_spine_(ops, max ? root->right : root->left, max);
+    update_(ops, root);
+}
+
+/* Restore the balance after an insertion into a subtree of the given node,
+ * the way the policy of the tree requires.
+ */
+static struct bstree_node *fix_insert_(struct bstree_node *root,
+        const struct bstree_ops *ops)
+{
+    if (ops->policy == POLICY_WAVL) {
+        return augment_(ops, root, wavl_fix_insert_(root));
+    }
+    return augment_(ops, root, balance_(root));
+}
+
+/* Restore the balance after a deletion from a subtree of the given node,
+ * the way the policy of the tree requires.
+ */
+static struct bstree_node *fix_remove_(struct bstree_node *root,
+        const struct bstree_ops *ops)
+{
+    if (ops->policy == POLICY_WAVL) {
+        return augment_(ops, root, wavl_fix_remove_(root));
+    }
+    return augment_(ops, root, balance_(root));
+}
+
+/* The hash index of a tree maps keys to the nodes holding them, so that
+ * point queries need not descend the tree. It is an open addressing table
+ * with linear probing, at most half full. Every slot caches the hash of
+ * the object, so that we only call the comparator on probable matches.
+ */
+static size_t index_home_(const struct bstree_index *index,
+        unsigned long hash)
+{
+    /* Fibonacci hashing, to scatter the poor hashes as well */
+    return (size_t)(((uint64_t)hash * UINT64_C(0x9e3779b97f4a7c15)) >>
+            (64 - index->bits));
+}
+
+static struct bstree_index *index_new_(int bits)
+{
+    struct bstree_index *index = malloc(sizeof *index);
+    index->bits = bits;
+    index->used = 0;
+    index->slots = calloc((size_t)1 << bits, sizeof *index->slots);
+    return index;
+}
+
+static void index_destroy_(struct bstree_index *index)
+{
+    if (index) {
+        free(index->slots);
+        free(index);
+    }
+}
+
+static void index_put_(struct bstree_index *index, unsigned long hash,
+        struct bstree_node *node)
+{
+    size_t mask = ((size_t)1 << index->bits) - 1;
+    size_t i = index_home_(index, hash);
+    while (index->slots[i].node) {
+        i = (i + 1) & mask;
+    }
+    index->slots[i].hash = hash;
+    index->slots[i].node = node;
+    index->used++;
+}
+
+static void index_add_(struct bstree_index *index,
+        const struct bstree_ops *ops, struct bstree_node *node)
+{
+    if (2 * (index->used + 1) > (size_t)1 << index->bits) {
+        struct bstree_index_slot *old = index->slots;
+        size_t i, n = (size_t)1 << index->bits;
+        index->bits++;
+        index->used = 0;
+        index->slots = calloc((size_t)1 << index->bits, sizeof *index->slots);
+        for (i = 0; i < n; i++) {
+            if (old[i].node) {
+                index_put_(index, old[i].hash, old[i].node);
+            }
+        }
+        free(old);
+    }
+    index_put_(index, ops->hash_object(node->object), node);
+}
+
+/* Return the node holding the key, NULL if there is no such node.
+ */
+static struct bstree_node *index_find_(const struct bstree_index *index,
+        const struct bstree_ops *ops, const void *key)
+{
+    size_t mask = ((size_t)1 << index->bits) - 1;
+    unsigned long hash = ops->hash_object(key);
+    size_t i = index_home_(index, hash);
+    while (index->slots[i].node) {
+        if (index->slots[i].hash == hash &&
+                ops->compare_object(key, index->slots[i].node->object) == 0) {
+            return index->slots[i].node;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Remove the node from the index. The entries after it in the probe
+ * sequence are shifted back, so that we need no tombstones.
+ */
+static void index_del_(struct bstree_index *index,
+        const struct bstree_ops *ops, struct bstree_node *node)
+{
+    size_t mask = ((size_t)1 << index->bits) - 1;
+    size_t i = index_home_(index, ops->hash_object(node->object));
+    size_t j, home;
+    while (index->slots[i].node != node) {
+        i = (i + 1) & mask;
+    }
+    for (j = (i + 1) & mask; index->slots[j].node; j = (j + 1) & mask) {
+        home = index_home_(index, index->slots[j].hash);
+        /* Move the entry back, unless its home lies cyclically in (i, j] */
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            index->slots[i] = index->slots[j];
+            i = j;
+        }
+    }
+    index->slots[i].node = NULL;
+    index->used--;
+}
+
+static struct bstree_node *slab_node_(struct bstree_slab *slab, size_t i)
+{
+    return (struct bstree_node *)((char *)slab->nodes + i * slab->stride);
+}
+
+static int in_slab_(const struct bstree_slab *slab,
+        const struct bstree_node *node)
+{
+    return slab && (const char *)node >= (const char *)slab->nodes &&
+        (const char *)node < (const char *)slab->nodes + slab->n * slab->stride;
+}
+
+/* Point the entry of a node to where it has been moved.
+ */
+static void index_move_(struct bstree_index *index,
+        const struct bstree_ops *ops, const struct bstree_node *from,
+        struct bstree_node *to)
+{
+    size_t mask = ((size_t)1 << index->bits) - 1;
+    size_t i = index_home_(index, ops->hash_object(from->object));
+    while (index->slots[i].node != from) {
+        i = (i + 1) & mask;
+    }
+    index->slots[i].node = to;
+}
+
+/* Make a node for the object, and let the tree know about it. 'key' is
+ * what probe_ made for the object.
+ */
+static struct bstree_node *new_node_(struct bstree *tree, void *object,
+        const void *key)
+{
+    struct bstree_node *node = tree->free_nodes;
+    if (node) {
+        tree->free_nodes = node->left;
+        node->object = object;
+        node->left = NULL;
+        node->right = NULL;
+        node->count = 1;
+        node->height = 0;
+    } else {
+        node = mknode_(object, node_size_(tree->ops));
+    }
+    tree->size++;
+    if (tree->ops->key) {
+        *str_key_(node) = ((const struct bstree_str_probe *)key)->key;
+    }
+    update_(tree->ops, node);
+    if (tree->index) {
+        index_add_(tree->index, tree->ops, node);
+    }
+    return node;
+}
+
+/* Free a node that has been unlinked from the tree. Its object must be
+ * still alive.
+ */
+static void free_node_(struct bstree *tree, struct bstree_node *node)
+{
+    tree->size--;
+    if (tree->index) {
+        index_del_(tree->index, tree->ops, node);
+    }
+    if (in_slab_(tree->slab, node)) {
+        node->left = tree->free_nodes;
+        tree->free_nodes = node;
+    } else {
+        free(node);
+    }
+}
+
+/* Take in an object equal to the one held at *held, either counting it
+ * in *count or replacing the old one.
+ */
+static void merge_(const struct bstree_ops *ops, void **held, int *count,
+        void *object, int replace)
+{
+    if (!replace) {
+        /* Inserting equal key. We are not going to hold the given pointer.
+         * If it is us who manages the lifetime (the ops->free_object != NULL),
+         * we should free it.
+         */
+        (*count)++;
+        if (ops->free_object) {
+            ops->free_object(object);
+        }
+    } else {
+        /* Inserting equal key. We are going to replace the existing object
+         * with the new one. We shall free the object if we have to
+         * (ops->free_object != NULL), then replace the pointer we hold.
+         */
+        if (ops->free_object) {
+            ops->free_object(*held);
+        }
+        *held = object;
+    }
+}
+
 static struct bstree_node *get_min_(struct bstree_node *root)
 {
     while (root && root->left) {
@@ -147,67 +750,148 @@ static struct bstree_node *get_min_(struct bstree_node *root)
     return root;
 }
 
-static struct bstree_node *insert_(struct bstree_node *root,
-        const struct bstree_ops *ops, void *object)
+static struct bstree_node *get_max_(struct bstree_node *root)
+{
+    while (root && root->right) {
+        root = root->right;
+    }
+    return root;
+}
+
+/* Inserts the object, 'key' is what probe_ made for it. The new node is the
+ * least (greatest) one in the tree if EDGE_MIN (EDGE_MAX) is still set in
+ * 'edges' when we get to it, and the fingers are moved to it in that case.
+ * With 'replace' set, an existing equal object is replaced instead of
+ * having its count incremented.
+ */
+static struct bstree_node *insert_(struct bstree *tree,
+        struct bstree_node *root, void *object, const void *key, int edges,
+        int replace)
 {
+    const struct bstree_ops *ops = tree->ops;
+    int cmp;
     if (!root) {
-        return mknode_(object);
+        root = new_node_(tree, object, key);
+        if (edges & EDGE_MIN) {
+            tree->min = root;
+        }
+        if (edges & EDGE_MAX) {
+            tree->max = root;
+        }
+        return root;
     }
-    if (ops->compare_object(object, root->object) < 0) {
-        root->left = insert_(root->left, ops, object);
-        return balance_(root);
+    cmp = compare_(ops, key, root);
+    if (cmp < 0) {
+        root->left = insert_(tree, root->left, object, key, edges & EDGE_MIN,
+                replace);
+        return fix_insert_(root, ops);
     }
-    if (ops->compare_object(object, root->object) > 0) {
-        root->right = insert_(root->right, ops, object);
-        return balance_(root);
+    if (cmp > 0) {
+        root->right = insert_(tree, root->right, object, key,
+                edges & EDGE_MAX, replace);
+        return fix_insert_(root, ops);
     }
-    /* Inserting equal key. We are not going to hold the given pointer.
-     * If it is us who manages the lifetime (the ops->free_object != NULL),
-     * we should free it.
-     */
-    root->count++;
-    if (ops->free_object) {
-        ops->free_object(object);
+    merge_(ops, &root->object, &root->count, object, replace);
+    update_(ops, root);
+    return root;
+}
+
+/* Link the given node in as the greatest one of the tree.
+ */
+static struct bstree_node *insert_max_(const struct bstree_ops *ops,
+        struct bstree_node *root, struct bstree_node *node)
+{
+    if (!root) {
+        return node;
     }
-    return balance_(root);
+    root->right = insert_max_(ops, root->right, node);
+    return fix_insert_(root, ops);
 }
 
-static struct bstree_node *replace_(struct bstree_node *root,
-        const struct bstree_ops *ops, void *object)
+/* Link the given node in as the least one of the tree.
+ */
+static struct bstree_node *insert_min_(const struct bstree_ops *ops,
+        struct bstree_node *root, struct bstree_node *node)
 {
     if (!root) {
-        return mknode_(object);
+        return node;
     }
-    if (ops->compare_object(object, root->object) < 0) {
-        root->left = replace_(root->left, ops, object);
-        return balance_(root);
+    root->left = insert_min_(ops, root->left, node);
+    return fix_insert_(root, ops);
+}
+
+/* Unlink the least node of the tree, placing it in *min.
+ */
+static struct bstree_node *detach_min_(const struct bstree_ops *ops,
+        struct bstree_node *root, struct bstree_node **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
     }
-    if (ops->compare_object(object, root->object) > 0) {
-        root->right = replace_(root->right, ops, object);
-        return balance_(root);
+    root->left = detach_min_(ops, root->left, min);
+    return fix_remove_(root, ops);
+}
+
+static struct bstree_node *detach_max_(const struct bstree_ops *ops,
+        struct bstree_node *root, struct bstree_node **max)
+{
+    if (!root->right) {
+        *max = root;
+        return root->left;
     }
-    /* Inserting equal key. We are going to replace the existing object with
-     * the new one. We shall free the object if we have to
-     * (ops->free_object != NULL), then replace the pointer in the node.
-     */
-    if (ops->free_object) {
-        ops->free_object(root->object);
+    root->right = detach_max_(ops, root->right, max);
+    return fix_remove_(root, ops);
+}
+
+/* Take one count off the extreme node, the least one if 'max' is false.
+ * The node goes once its count drops to zero, the object is left to the
+ * caller and *removed is set. Returns the object.
+ */
+static void *pop_(struct bstree *tree, int max, int *removed)
+{
+    struct bstree_node *node = max ? tree->max : tree->min;
+    void *object;
+    if (!node) {
+        return NULL;
     }
-    root->object = object;
-    return balance_(root);
+    object = node->object;
+    if (node->count > 1) {
+        node->count--;
+        update_spine_(tree->ops, tree->root, max);
+        return object;
+    }
+    /* The extreme node is at the end of a spine, no need to compare */
+    if (max) {
+        tree->root = detach_max_(tree->ops, tree->root, &node);
+        tree->max = get_max_(tree->root);
+    } else {
+        tree->root = detach_min_(tree->ops, tree->root, &node);
+        tree->min = get_min_(tree->root);
+    }
+    if (!tree->root) {
+        tree->min = NULL;
+        tree->max = NULL;
+    }
+    free_node_(tree, node);
+    *removed = 1;
+    return object;
 }
 
-static void destroy_(struct bstree_node *root, const struct bstree_ops *ops)
+static void destroy_(struct bstree_node *root, const struct bstree_ops *ops,
+        const struct bstree_slab *slab)
 {
     if (!root) {
         return;
     }
-    destroy_(root->left, ops);
-    destroy_(root->right, ops);
+    destroy_(root->left, ops, slab);
+    destroy_(root->right, ops, slab);
     if (ops->free_object) {
         ops->free_object(root->object);
     }
-    free(root);
+    if (!in_slab_(slab, root)) {
+        free(root);
+    }
 }
 
 static int traverse_inorder_(const struct bstree_node *root,
@@ -315,10 +999,10 @@ static int count_(const struct bstree_node *root,
     if (!root) {
         return 0;
     }
-    if (ops->compare_object(object, root->object) < 0) {
+    if (compare_(ops, object, root) < 0) {
         return count_(root->left, ops, object);
     }
-    if (ops->compare_object(object, root->object) > 0) {
+    if (compare_(ops, object, root) > 0) {
         return count_(root->right, ops, object);
     }
     return root->count;
@@ -330,162 +1014,2746 @@ static void *search_(const struct bstree_node *root,
     if (!root) {
         return NULL;
     }
-    if (ops->compare_object(key, root->object) < 0) {
+    if (compare_(ops, key, root) < 0) {
         return search_(root->left, ops, key);
     }
-    if (ops->compare_object(key, root->object) > 0) {
+    if (compare_(ops, key, root) > 0) {
         return search_(root->right, ops, key);
     }
     return root->object;
 }
 
-/* Removes the node matching the key,
- * frees the object if ops->free_object is not NULL.
+/* Aggregation over a range of keys of an augmented tree. The pieces are
+ * combined in order into 'out', 'have' tells if it holds anything yet.
+ * Whole subtrees are taken by their aggregates, so only the two paths to
+ * the ends of the range are walked.
  */
-static struct bstree_node *remove_(struct bstree_node *root,
-        const struct bstree_ops *ops, const void *key)
+struct range_agg {
+    const struct bstree_ops *ops;
+    void *out;
+    /* For the aggregates of single nodes */
+    void *scratch;
+    int have;
+};
+
+static void range_add_(struct range_agg *r, const void *agg)
 {
-    if (!root) {
-        return NULL;
-    }
-    if (ops->compare_object(key, root->object) < 0) {
-         root->left = remove_(root->left, ops, key);
-         return balance_(root);
-    }
-    if (ops->compare_object(key, root->object) > 0) {
-        root->right = remove_(root->right, ops, key);
-        return balance_(root);
-    }
-    /* Found the node to be deleted */
-    if (!root->left || !root->right) {
-        struct bstree_node *tmp = root->left ? root->left : root->right;
-        if (ops->free_object) {
-            ops->free_object(root->object);
-        }
-        free(root);
-        return tmp;
-    }
-    /* Node to be deleted has two children */
-    struct bstree_node *right_min = get_min_(root->right);
-    /* As we get the pointer held at right_min and put it inside root, we shall
-     * remove right_min without free'ing the object it holds.
-     * For this reason, we call the remove function with a NULL free_object.
-     */
-    struct bstree_ops tmp_ops = *ops;
-    tmp_ops.free_object = NULL;
-    if (ops->free_object) {
-        ops->free_object(root->object);
+    if (r->have) {
+        r->ops->combine(r->out, r->out, agg);
+    } else {
+        memcpy(r->out, agg, r->ops->agg_size);
+        r->have = 1;
     }
-    root->object = right_min->object;
-    root->right = remove_(root->right, &tmp_ops, right_min->object);
-    return balance_(root);
 }
 
-static int size_(struct bstree_node *root)
+static void range_add_node_(struct range_agg *r,
+        const struct bstree_node *node)
 {
-    if (!root) {
-        return 0;
-    }
-    return size_(root->left) + size_(root->right) + 1;
+    r->ops->leaf(r->scratch, node->object, node->count);
+    range_add_(r, r->scratch);
 }
 
-/* Interface functions
+/* Add the nodes of the subtree that are not less than lo.
  */
-
-struct bstree *bstree_new(
-        int (*compare_object)(const void *lhs, const void *rhs),
-        void (*free_object)(void *object))
+static void range_from_(struct range_agg *r, const struct bstree_node *root,
+        const void *lo)
 {
-    struct bstree *tree;
+    if (!root) {
+        return;
+    }
+    if (compare_(r->ops, lo, root) > 0) {
+        range_from_(r, root->right, lo);
+        return;
+    }
+    range_from_(r, root->left, lo);
+    range_add_node_(r, root);
+    if (root->right) {
+        range_add_(r, agg_(root->right));
+    }
+}
+
+/* Add the nodes of the subtree that are not greater than hi.
+ */
+static void range_to_(struct range_agg *r, const struct bstree_node *root,
+        const void *hi)
+{
+    if (!root) {
+        return;
+    }
+    if (compare_(r->ops, hi, root) < 0) {
+        range_to_(r, root->left, hi);
+        return;
+    }
+    if (root->left) {
+        range_add_(r, agg_(root->left));
+    }
+    range_add_node_(r, root);
+    range_to_(r, root->right, hi);
+}
+
+/* Find the node where the paths to lo and hi part, and add the range from
+ * both sides of it.
+ */
+static void range_(struct range_agg *r, const struct bstree_node *root,
+        const void *lo, const void *hi)
+{
+    while (root) {
+        if (compare_(r->ops, lo, root) > 0) {
+            root = root->right;
+        } else if (compare_(r->ops, hi, root) < 0) {
+            root = root->left;
+        } else {
+            range_from_(r, root->left, lo);
+            range_add_node_(r, root);
+            range_to_(r, root->right, hi);
+            return;
+        }
+    }
+}
+
+/* Removes the node matching the key, frees the object if free_object is
+ * not NULL. If the node was one of the fingers, the finger is cleared,
+ * see refresh_fingers_.
+ */
+static struct bstree_node *remove_(struct bstree *tree,
+        struct bstree_node *root, const void *key,
+        void (*free_object)(void *object))
+{
+    struct bstree_node *tmp;
+    void *object;
+    int cmp;
+    if (!root) {
+        return NULL;
+    }
+    cmp = compare_(tree->ops, key, root);
+    if (cmp < 0) {
+        root->left = remove_(tree, root->left, key, free_object);
+        return fix_remove_(root, tree->ops);
+    }
+    if (cmp > 0) {
+        root->right = remove_(tree, root->right, key, free_object);
+        return fix_remove_(root, tree->ops);
+    }
+    /* Found the node to be deleted */
+    if (root == tree->min) {
+        tree->min = NULL;
+    }
+    if (root == tree->max) {
+        tree->max = NULL;
+    }
+    if (!root->left || !root->right) {
+        tmp = root->left ? root->left : root->right;
+    } else {
+        /* Node to be deleted has two children. We unlink its successor and
+         * put it in its place, so that every object stays in the node it
+         * was inserted in.
+         */
+        root->right = detach_min_(tree->ops, root->right, &tmp);
+        tmp->left = root->left;
+        tmp->right = root->right;
+        tmp->height = root->height;
+        tmp = fix_remove_(tmp, tree->ops);
+    }
+    object = root->object;
+    free_node_(tree, root);
+    if (free_object) {
+        free_object(object);
+    }
+    return tmp;
+}
+
+/* Find the extreme nodes again if they were removed.
+ */
+static void refresh_fingers_(struct bstree *tree)
+{
+    if (!tree->min) {
+        tree->min = get_min_(tree->root);
+    }
+    if (!tree->max) {
+        tree->max = get_max_(tree->root);
+    }
+}
+
+/* Compute the height, for the trees where it is not what the nodes hold.
+ */
+static int real_height_(struct bstree_node *root)
+{
+    if (!root) {
+        return -1;
+    }
+    return int_max_(real_height_(root->left), real_height_(root->right)) + 1;
+}
+
+/* Helper functions of the fat engine
+ */
+
+static int fat_height_(struct bstree_fat_node *root)
+{
+    return root ? root->height : -1;
+}
+
+static struct bstree_fat_node *fat_mknode_(void *object)
+{
+    struct bstree_fat_node *root = malloc(sizeof *root);
+    root->left = NULL;
+    root->right = NULL;
+    root->n = 1;
+    root->height = 0;
+    root->objects[0] = object;
+    root->counts[0] = 1;
+    return root;
+}
+
+static struct bstree_fat_node *fat_rotate_with_left_(
+        struct bstree_fat_node *root)
+{
+    struct bstree_fat_node *newroot = root->left;
+    root->left = newroot->right;
+    newroot->right = root;
+    root->height = int_max_(fat_height_(root->left),
+            fat_height_(root->right)) + 1;
+    newroot->height = int_max_(fat_height_(newroot->left),
+            fat_height_(newroot->right)) + 1;
+    return newroot;
+}
+
+static struct bstree_fat_node *fat_rotate_with_right_(
+        struct bstree_fat_node *root)
+{
+    struct bstree_fat_node *newroot = root->right;
+    root->right = newroot->left;
+    newroot->left = root;
+    root->height = int_max_(fat_height_(root->left),
+            fat_height_(root->right)) + 1;
+    newroot->height = int_max_(fat_height_(newroot->left),
+            fat_height_(newroot->right)) + 1;
+    return newroot;
+}
+
+/* Same as balance_, for fat nodes.
+ */
+static struct bstree_fat_node *fat_balance_(struct bstree_fat_node *root)
+{
+    if (!root) {
+        return NULL;
+    }
+    if (fat_height_(root->left) - fat_height_(root->right) > MAX_IMBALANCE) {
+        if (fat_height_(root->left->left) >=
+                fat_height_(root->left->right)) {
+            root = fat_rotate_with_left_(root);
+        } else {
+            root->left = fat_rotate_with_right_(root->left);
+            root = fat_rotate_with_left_(root);
+        }
+    } else if (fat_height_(root->right) - fat_height_(root->left)
+            > MAX_IMBALANCE) {
+        if (fat_height_(root->right->right) >=
+                fat_height_(root->right->left)) {
+            root = fat_rotate_with_right_(root);
+        } else {
+            root->right = fat_rotate_with_left_(root->right);
+            root = fat_rotate_with_right_(root);
+        }
+    }
+    root->height = int_max_(fat_height_(root->left),
+            fat_height_(root->right)) + 1;
+    return root;
+}
+
+/* Find where the key belongs among the objects of the node, assuming it is
+ * not less than the first and not greater than the last one.
+ * Returns the index of the first object not less than the key,
+ * sets *found if that object is equal to the key.
+ * The comparator is opaque to us, so we do a binary search to make as few
+ * calls to it as possible.
+ */
+static int fat_bound_(const struct bstree_fat_node *root,
+        const struct bstree_ops *ops, const void *key, int *found)
+{
+    int lo = 0, hi = root->n;
+    *found = 0;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = ops->compare_object(key, root->objects[mid]);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/* Find the node holding the key, and the index of the key in it.
+ * Returns NULL if the key is not found.
+ */
+static struct bstree_fat_node *fat_locate_(struct bstree_fat_node *root,
+        const struct bstree_ops *ops, const void *key, int *index)
+{
+    int found;
+    while (root) {
+        if (ops->compare_object(key, root->objects[0]) < 0) {
+            root = root->left;
+        } else if (ops->compare_object(key, root->objects[root->n - 1]) > 0) {
+            root = root->right;
+        } else {
+            *index = fat_bound_(root, ops, key, &found);
+            return found ? root : NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Attach the given node as the leftmost one of the tree.
+ */
+static struct bstree_fat_node *fat_attach_min_(struct bstree_fat_node *root,
+        struct bstree_fat_node *node)
+{
+    if (!root) {
+        return node;
+    }
+    root->left = fat_attach_min_(root->left, node);
+    return fat_balance_(root);
+}
+
+/* Attach the given node as the rightmost one of the tree.
+ */
+static struct bstree_fat_node *fat_attach_max_(struct bstree_fat_node *root,
+        struct bstree_fat_node *node)
+{
+    if (!root) {
+        return node;
+    }
+    root->right = fat_attach_max_(root->right, node);
+    return fat_balance_(root);
+}
+
+/* Detach the leftmost node of the tree, placing it in *min.
+ */
+static struct bstree_fat_node *fat_detach_min_(struct bstree_fat_node *root,
+        struct bstree_fat_node **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = fat_detach_min_(root->left, min);
+    return fat_balance_(root);
+}
+
+static void fat_insert_at_(struct bstree_fat_node *root, int i, void *object)
+{
+    memmove(root->objects + i + 1, root->objects + i,
+            (root->n - i) * sizeof *root->objects);
+    memmove(root->counts + i + 1, root->counts + i,
+            (root->n - i) * sizeof *root->counts);
+    root->objects[i] = object;
+    root->counts[i] = 1;
+    root->n++;
+}
+
+static void fat_remove_at_(struct bstree_fat_node *root, int i)
+{
+    root->n--;
+    memmove(root->objects + i, root->objects + i + 1,
+            (root->n - i) * sizeof *root->objects);
+    memmove(root->counts + i, root->counts + i + 1,
+            (root->n - i) * sizeof *root->counts);
+}
+
+/* Insert the object into the fat tree. With 'replace' set, an existing equal
+ * object is replaced instead of having its count incremented, just like
+ * insert_ does.
+ */
+static struct bstree_fat_node *fat_insert_(struct bstree_fat_node *root,
+        const struct bstree_ops *ops, void *object, int replace)
+{
+    struct bstree_fat_node *split;
+    int i, found;
+    if (!root) {
+        return fat_mknode_(object);
+    }
+    if (ops->compare_object(object, root->objects[0]) < 0) {
+        if (root->left) {
+            root->left = fat_insert_(root->left, ops, object, replace);
+            return fat_balance_(root);
+        }
+        i = 0;
+        found = 0;
+    } else if (ops->compare_object(object, root->objects[root->n - 1]) > 0) {
+        if (root->right) {
+            root->right = fat_insert_(root->right, ops, object, replace);
+            return fat_balance_(root);
+        }
+        i = root->n;
+        found = 0;
+    } else {
+        i = fat_bound_(root, ops, object, &found);
+    }
+    if (found) {
+        /* Equal key, see insert_ for the ownership rules */
+        if (!replace) {
+            root->counts[i]++;
+            if (ops->free_object) {
+                ops->free_object(object);
+            }
+        } else {
+            if (ops->free_object) {
+                ops->free_object(root->objects[i]);
+            }
+            root->objects[i] = object;
+        }
+        return root;
+    }
+    if (root->n < FAT_CAPACITY) {
+        fat_insert_at_(root, i, object);
+        return root;
+    }
+    /* The node is full. If the object goes to either end, it starts a node
+     * of its own, so that sorted insertions leave full nodes behind.
+     * Otherwise the upper half of the node is split off.
+     * Either way, the new node is adjacent to this one in order.
+     */
+    if (i == 0) {
+        root->left = fat_attach_max_(root->left, fat_mknode_(object));
+        return fat_balance_(root);
+    }
+    if (i == FAT_CAPACITY) {
+        root->right = fat_attach_min_(root->right, fat_mknode_(object));
+        return fat_balance_(root);
+    }
+    split = malloc(sizeof *split);
+    split->left = NULL;
+    split->right = NULL;
+    split->height = 0;
+    split->n = FAT_CAPACITY / 2;
+    root->n = FAT_CAPACITY - split->n;
+    memcpy(split->objects, root->objects + root->n,
+            split->n * sizeof *split->objects);
+    memcpy(split->counts, root->counts + root->n,
+            split->n * sizeof *split->counts);
+    if (i <= root->n) {
+        fat_insert_at_(root, i, object);
+    } else {
+        fat_insert_at_(split, i - root->n, object);
+    }
+    root->right = fat_attach_min_(root->right, split);
+    return fat_balance_(root);
+}
+
+/* Removes the key from the fat tree, freeing the object if free_object
+ * is given. A node is merged with its successor when it gets too sparse,
+ * and is unlinked when it gets empty.
+ */
+static struct bstree_fat_node *fat_remove_(struct bstree_fat_node *root,
+        const struct bstree_ops *ops, const void *key,
+        void (*free_object)(void *object))
+{
+    struct bstree_fat_node *succ;
+    int i, found;
+    if (!root) {
+        return NULL;
+    }
+    if (ops->compare_object(key, root->objects[0]) < 0) {
+        root->left = fat_remove_(root->left, ops, key, free_object);
+        return fat_balance_(root);
+    }
+    if (ops->compare_object(key, root->objects[root->n - 1]) > 0) {
+        root->right = fat_remove_(root->right, ops, key, free_object);
+        return fat_balance_(root);
+    }
+    i = fat_bound_(root, ops, key, &found);
+    if (!found) {
+        return root;
+    }
+    if (free_object) {
+        free_object(root->objects[i]);
+    }
+    fat_remove_at_(root, i);
+    if (root->right && root->n < FAT_CAPACITY / 4) {
+        succ = root->right;
+        while (succ->left) {
+            succ = succ->left;
+        }
+        if (root->n + succ->n <= FAT_CAPACITY) {
+            memcpy(root->objects + root->n, succ->objects,
+                    succ->n * sizeof *succ->objects);
+            memcpy(root->counts + root->n, succ->counts,
+                    succ->n * sizeof *succ->counts);
+            root->n += succ->n;
+            root->right = fat_detach_min_(root->right, &succ);
+            free(succ);
+            return fat_balance_(root);
+        }
+    }
+    if (root->n > 0) {
+        return root;
+    }
+    /* The node got empty */
+    if (!root->left || !root->right) {
+        succ = root->left ? root->left : root->right;
+        free(root);
+        return succ;
+    }
+    root->right = fat_detach_min_(root->right, &succ);
+    succ->left = root->left;
+    succ->right = root->right;
+    free(root);
+    return fat_balance_(succ);
+}
+
+static const struct bstree_fat_node *fat_min_(
+        const struct bstree_fat_node *root)
+{
+    while (root && root->left) {
+        root = root->left;
+    }
+    return root;
+}
+
+static const struct bstree_fat_node *fat_max_(
+        const struct bstree_fat_node *root)
+{
+    while (root && root->right) {
+        root = root->right;
+    }
+    return root;
+}
+
+/* Same as pop_, for fat trees. There must be at least one object.
+ */
+static struct bstree_fat_node *fat_pop_(struct bstree_fat_node *root,
+        int max, void **object, int *removed)
+{
+    struct bstree_fat_node *child = max ? root->right : root->left;
+    int i = max ? root->n - 1 : 0;
+    if (child) {
+        if (max) {
+            root->right = fat_pop_(child, max, object, removed);
+        } else {
+            root->left = fat_pop_(child, max, object, removed);
+        }
+        return fat_balance_(root);
+    }
+    *object = root->objects[i];
+    if (root->counts[i] > 1) {
+        root->counts[i]--;
+        return root;
+    }
+    fat_remove_at_(root, i);
+    *removed = 1;
+    if (root->n > 0) {
+        return root;
+    }
+    /* The node got empty, it has at most one child */
+    child = max ? root->left : root->right;
+    free(root);
+    return child;
+}
+
+static void fat_destroy_(struct bstree_fat_node *root,
+        const struct bstree_ops *ops)
+{
+    int i;
+    if (!root) {
+        return;
+    }
+    fat_destroy_(root->left, ops);
+    fat_destroy_(root->right, ops);
+    if (ops->free_object) {
+        for (i = 0; i < root->n; i++) {
+            ops->free_object(root->objects[i]);
+        }
+    }
+    free(root);
+}
+
+/* Apply the operation to the objects of a single node, 'count' times each
+ * if 'use_count' is set.
+ */
+static int fat_visit_(const struct bstree_fat_node *root, int use_count,
+        void *it_data, int (*operation)(void *object, void *it_data))
+{
+    int i, j;
+    for (i = 0; i < root->n; i++) {
+        for (j = 0; j < (use_count ? root->counts[i] : 1); j++) {
+            if (operation(root->objects[i], it_data)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int fat_traverse_inorder_(const struct bstree_fat_node *root,
+        int use_count, void *it_data,
+        int (*operation)(void *object, void *it_data))
+{
+    return
+        root &&
+        (fat_traverse_inorder_(root->left, use_count, it_data, operation) ||
+        fat_visit_(root, use_count, it_data, operation) ||
+        fat_traverse_inorder_(root->right, use_count, it_data, operation));
+}
+
+static int fat_traverse_preorder_(const struct bstree_fat_node *root,
+        int use_count, void *it_data,
+        int (*operation)(void *object, void *it_data))
+{
+    return
+        root &&
+        (fat_visit_(root, use_count, it_data, operation) ||
+        fat_traverse_preorder_(root->left, use_count, it_data, operation) ||
+        fat_traverse_preorder_(root->right, use_count, it_data, operation));
+}
+
+static int fat_traverse_postorder_(const struct bstree_fat_node *root,
+        int use_count, void *it_data,
+        int (*operation)(void *object, void *it_data))
+{
+    return
+        root &&
+        (fat_traverse_postorder_(root->left, use_count, it_data, operation) ||
+        fat_traverse_postorder_(root->right, use_count, it_data, operation) ||
+        fat_visit_(root, use_count, it_data, operation));
+}
+
+static int fat_size_(struct bstree_fat_node *root)
+{
+    if (!root) {
+        return 0;
+    }
+    return fat_size_(root->left) + fat_size_(root->right) + root->n;
+}
+
+/* Iterative traversals delivering objects in batches
+ */
+
+/* Deep enough for any tree that fits in memory, heights are logarithmic
+ * under every policy we have.
+ */
+#define STACK_DEPTH 128
+
+struct chunk_buffer {
+    void **objects;
+    int *counts;
+    int cap;
+    int n;
+    void *it_data;
+    int (*operation)(void **objects, int *counts, int n, void *it_data);
+};
+
+/* Put an object in the buffer, handing the buffer over if it gets full.
+ * Returns true if the operation says to stop.
+ */
+static int chunk_put_(struct chunk_buffer *buf, void *object, int count)
+{
+    buf->objects[buf->n] = object;
+    if (buf->counts) {
+        buf->counts[buf->n] = count;
+    }
+    if (++buf->n < buf->cap) {
+        return 0;
+    }
+    buf->n = 0;
+    return buf->operation(buf->objects, buf->counts, buf->cap, buf->it_data);
+}
+
+/* Put a run of objects (of a fat node or a small tree) in the buffer,
+ * copying as much as fits at a time.
+ */
+static int chunk_put_run_(struct chunk_buffer *buf, void *const *objects,
+        const int *counts, int n)
+{
+    int i, len;
+    for (i = 0; i < n; i += len) {
+        len = int_min_(n - i, buf->cap - buf->n);
+        memcpy(buf->objects + buf->n, objects + i,
+                len * sizeof *buf->objects);
+        if (buf->counts) {
+            memcpy(buf->counts + buf->n, counts + i,
+                    len * sizeof *buf->counts);
+        }
+        buf->n += len;
+        if (buf->n == buf->cap) {
+            buf->n = 0;
+            if (buf->operation(buf->objects, buf->counts, buf->cap,
+                        buf->it_data)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int traverse_chunks_(const struct bstree_node *root,
+        enum bstree_order order, struct chunk_buffer *buf)
+{
+    const struct bstree_node *stack[STACK_DEPTH];
+    const struct bstree_node *node = root, *last = NULL;
+    int sp = 0;
+    switch (order) {
+    case BSTREE_INORDER:
+        while (node || sp) {
+            for (; node; node = node->left) {
+                stack[sp++] = node;
+            }
+            node = stack[--sp];
+            if (chunk_put_(buf, node->object, node->count)) {
+                return 1;
+            }
+            node = node->right;
+        }
+        break;
+    case BSTREE_PREORDER:
+        if (node) {
+            stack[sp++] = node;
+        }
+        while (sp) {
+            node = stack[--sp];
+            if (chunk_put_(buf, node->object, node->count)) {
+                return 1;
+            }
+            if (node->right) {
+                stack[sp++] = node->right;
+            }
+            if (node->left) {
+                stack[sp++] = node->left;
+            }
+        }
+        break;
+    case BSTREE_POSTORDER:
+        /* A node is done once we come back to it from its right subtree,
+         * or from the left one if it has no right subtree.
+         */
+        while (node || sp) {
+            for (; node; node = node->left) {
+                stack[sp++] = node;
+            }
+            node = stack[sp - 1];
+            if (node->right && node->right != last) {
+                node = node->right;
+                continue;
+            }
+            if (chunk_put_(buf, node->object, node->count)) {
+                return 1;
+            }
+            last = stack[--sp];
+            node = NULL;
+        }
+        break;
+    }
+    return 0;
+}
+
+/* Same as traverse_chunks_, for fat nodes.
+ */
+static int fat_traverse_chunks_(const struct bstree_fat_node *root,
+        enum bstree_order order, struct chunk_buffer *buf)
+{
+    const struct bstree_fat_node *stack[STACK_DEPTH];
+    const struct bstree_fat_node *node = root, *last = NULL;
+    int sp = 0;
+    switch (order) {
+    case BSTREE_INORDER:
+        while (node || sp) {
+            for (; node; node = node->left) {
+                stack[sp++] = node;
+            }
+            node = stack[--sp];
+            if (chunk_put_run_(buf, node->objects, node->counts, node->n)) {
+                return 1;
+            }
+            node = node->right;
+        }
+        break;
+    case BSTREE_PREORDER:
+        if (node) {
+            stack[sp++] = node;
+        }
+        while (sp) {
+            node = stack[--sp];
+            if (chunk_put_run_(buf, node->objects, node->counts, node->n)) {
+                return 1;
+            }
+            if (node->right) {
+                stack[sp++] = node->right;
+            }
+            if (node->left) {
+                stack[sp++] = node->left;
+            }
+        }
+        break;
+    case BSTREE_POSTORDER:
+        while (node || sp) {
+            for (; node; node = node->left) {
+                stack[sp++] = node;
+            }
+            node = stack[sp - 1];
+            if (node->right && node->right != last) {
+                node = node->right;
+                continue;
+            }
+            if (chunk_put_run_(buf, node->objects, node->counts, node->n)) {
+                return 1;
+            }
+            last = stack[--sp];
+            node = NULL;
+        }
+        break;
+    }
+    return 0;
+}
+
+/* Shared ops
+ */
+
+/* Every distinct set of functions given to the constructors gets one ops,
+ * shared by all the trees made with it, and freed with the last of them.
+ * The lock is taken by the reclaimer thread as well.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct bstree_ops *head;
+} shared_ops = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static void ops_init_(struct bstree_ops *ops,
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object), enum bstree_engine engine,
+        enum bstree_policy policy)
+{
+    ops->compare_object = compare_object;
+    ops->free_object = free_object;
+    ops->hash_object = NULL;
+    ops->engine = engine;
+    ops->policy = policy;
+    ops->agg_size = 0;
+    ops->leaf = NULL;
+    ops->combine = NULL;
+    ops->key = NULL;
+    ops->refs = 0;
+    ops->next = NULL;
+}
+
+static int ops_equal_(const struct bstree_ops *lhs,
+        const struct bstree_ops *rhs)
+{
+    return lhs->compare_object == rhs->compare_object &&
+        lhs->free_object == rhs->free_object &&
+        lhs->hash_object == rhs->hash_object &&
+        lhs->engine == rhs->engine &&
+        lhs->policy == rhs->policy &&
+        lhs->agg_size == rhs->agg_size &&
+        lhs->leaf == rhs->leaf &&
+        lhs->combine == rhs->combine &&
+        lhs->key == rhs->key;
+}
+
+/* Return the shared ops equal to the given ones, making them if needed.
+ */
+static struct bstree_ops *ops_get_(const struct bstree_ops *ops)
+{
+    struct bstree_ops *shared;
+    pthread_mutex_lock(&shared_ops.lock);
+    for (shared = shared_ops.head; shared; shared = shared->next) {
+        if (ops_equal_(shared, ops)) {
+            break;
+        }
+    }
+    if (!shared) {
+        shared = malloc(sizeof *shared);
+        *shared = *ops;
+        shared->refs = 0;
+        shared->next = shared_ops.head;
+        shared_ops.head = shared;
+    }
+    shared->refs++;
+    pthread_mutex_unlock(&shared_ops.lock);
+    return shared;
+}
+
+static void ops_put_(struct bstree_ops *ops)
+{
+    struct bstree_ops **link;
+    pthread_mutex_lock(&shared_ops.lock);
+    if (--ops->refs == 0) {
+        for (link = &shared_ops.head; *link != ops; link = &(*link)->next) {
+            ;
+        }
+        *link = ops->next;
+        free(ops);
+    }
+    pthread_mutex_unlock(&shared_ops.lock);
+}
+
+/* Background reclamation of destroyed trees
+ */
+
+/* Number of nodes freed in one go, before letting other threads have
+ * the allocator.
+ */
+#define RECLAIM_SLICE 4096
+
+struct reclaim_job {
+    struct reclaim_job *next;
+    enum bstree_engine engine;
+    union {
+        struct bstree_node *root;
+        struct bstree_fat_node *fat_root;
+    };
+    struct bstree_ops *ops;
+    struct bstree_slab *slab;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    /* Signalled when a job is queued */
+    pthread_cond_t work;
+    /* Signalled when every job queued so far is done */
+    pthread_cond_t idle;
+    struct reclaim_job *head;
+    struct reclaim_job *tail;
+    int pending;
+    int started;
+} reclaimer = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0
+};
+
+/* Free up to 'budget' nodes of the tree, without recursion. The left child
+ * of the root is rotated up until there is none, then the root has at most
+ * one child and it can go. Returns what is left of the tree.
+ */
+static struct bstree_node *reclaim_slice_(struct bstree_node *root,
+        const struct bstree_ops *ops, const struct bstree_slab *slab,
+        int budget)
+{
+    struct bstree_node *tmp;
+    while (root && budget > 0) {
+        if (root->left) {
+            tmp = root->left;
+            root->left = tmp->right;
+            tmp->right = root;
+            root = tmp;
+        } else {
+            tmp = root->right;
+            if (ops->free_object) {
+                ops->free_object(root->object);
+            }
+            if (!in_slab_(slab, root)) {
+                free(root);
+            }
+            root = tmp;
+            budget--;
+        }
+    }
+    return root;
+}
+
+/* Same as reclaim_slice_, for fat nodes.
+ */
+static struct bstree_fat_node *fat_reclaim_slice_(
+        struct bstree_fat_node *root, const struct bstree_ops *ops,
+        int budget)
+{
+    struct bstree_fat_node *tmp;
+    int i;
+    while (root && budget > 0) {
+        if (root->left) {
+            tmp = root->left;
+            root->left = tmp->right;
+            tmp->right = root;
+            root = tmp;
+        } else {
+            tmp = root->right;
+            if (ops->free_object) {
+                for (i = 0; i < root->n; i++) {
+                    ops->free_object(root->objects[i]);
+                }
+            }
+            budget -= root->n;
+            free(root);
+            root = tmp;
+        }
+    }
+    return root;
+}
+
+/* Free the whole tree of the job, a slice at a time.
+ */
+static void reclaim_(struct reclaim_job *job)
+{
+    int done;
+    for (;;) {
+        if (job->engine == ENGINE_FAT) {
+            job->fat_root = fat_reclaim_slice_(job->fat_root, job->ops,
+                    RECLAIM_SLICE);
+            done = !job->fat_root;
+        } else {
+            job->root = reclaim_slice_(job->root, job->ops, job->slab,
+                    RECLAIM_SLICE);
+            done = !job->root;
+        }
+        if (done) {
+            break;
+        }
+        sched_yield();
+    }
+    free(job->slab);
+    ops_put_(job->ops);
+    free(job);
+}
+
+static void *reclaimer_main_(void *arg)
+{
+    struct reclaim_job *job;
+    (void)arg;
+    pthread_mutex_lock(&reclaimer.lock);
+    for (;;) {
+        while (!reclaimer.head) {
+            pthread_cond_wait(&reclaimer.work, &reclaimer.lock);
+        }
+        job = reclaimer.head;
+        reclaimer.head = job->next;
+        if (!reclaimer.head) {
+            reclaimer.tail = NULL;
+        }
+        pthread_mutex_unlock(&reclaimer.lock);
+        reclaim_(job);
+        pthread_mutex_lock(&reclaimer.lock);
+        if (--reclaimer.pending == 0) {
+            pthread_cond_broadcast(&reclaimer.idle);
+        }
+    }
+    return NULL;
+}
+
+/* Hand the job over to the reclaimer thread, starting it if needed.
+ * Returns false if there is no thread to take it.
+ */
+static int reclaim_async_(struct reclaim_job *job)
+{
+    pthread_t thread;
+    pthread_mutex_lock(&reclaimer.lock);
+    if (!reclaimer.started) {
+        if (pthread_create(&thread, NULL, reclaimer_main_, NULL)) {
+            pthread_mutex_unlock(&reclaimer.lock);
+            return 0;
+        }
+        pthread_detach(thread);
+        reclaimer.started = 1;
+    }
+    job->next = NULL;
+    if (reclaimer.tail) {
+        reclaimer.tail->next = job;
+    } else {
+        reclaimer.head = job;
+    }
+    reclaimer.tail = job;
+    reclaimer.pending++;
+    pthread_cond_signal(&reclaimer.work);
+    pthread_mutex_unlock(&reclaimer.lock);
+    return 1;
+}
+
+/* Compaction
+ */
+
+/* Bytes the allocator actually holds for a block of the given size.
+ */
+static size_t alloc_size_(void *block, size_t size)
+{
+#ifdef __GLIBC__
+    (void)size;
+    return malloc_usable_size(block);
+#else
+    (void)block;
+    return size;
+#endif
+}
+
+/* Move the nodes of the tree into the slab, in order starting at slot *i,
+ * and free the old ones. The old slab, if any, is left to the caller.
+ * Returns the new root.
+ */
+static struct bstree_node *compact_(struct bstree *tree,
+        struct bstree_node *root, struct bstree_slab *slab, size_t *i,
+        size_t *freed)
+{
+    struct bstree_node *node, *left;
+    if (!root) {
+        return NULL;
+    }
+    left = compact_(tree, root->left, slab, i, freed);
+    node = slab_node_(slab, (*i)++);
+    memcpy(node, root, slab->stride);
+    node->left = left;
+    node->right = compact_(tree, root->right, slab, i, freed);
+    if (tree->index) {
+        index_move_(tree->index, tree->ops, root, node);
+    }
+    if (!in_slab_(tree->slab, root)) {
+        *freed += alloc_size_(root, slab->stride);
+        free(root);
+    }
+    return node;
+}
+
+/* Small trees
+ */
+
+/* Return where the key is, or would go, in the array of a small tree.
+ * *found is set if it is there.
+ */
+static int small_find_(const struct bstree *tree, const void *key,
+        int *found)
+{
+    int i, cmp;
+    for (i = 0; i < tree->size; i++) {
+        cmp = tree->ops->compare_object(key, tree->array.objects[i]);
+        if (cmp <= 0) {
+            *found = cmp == 0;
+            return i;
+        }
+    }
+    *found = 0;
+    return i;
+}
+
+static void small_insert_at_(struct bstree *tree, int i, void *object)
+{
+    struct bstree_small *array = &tree->array;
+    memmove(array->objects + i + 1, array->objects + i,
+            (tree->size - i) * sizeof *array->objects);
+    memmove(array->counts + i + 1, array->counts + i,
+            (tree->size - i) * sizeof *array->counts);
+    array->objects[i] = object;
+    array->counts[i] = 1;
+    tree->size++;
+}
+
+static void small_remove_at_(struct bstree *tree, int i)
+{
+    struct bstree_small *array = &tree->array;
+    tree->size--;
+    memmove(array->objects + i, array->objects + i + 1,
+            (tree->size - i) * sizeof *array->objects);
+    memmove(array->counts + i, array->counts + i + 1,
+            (tree->size - i) * sizeof *array->counts);
+}
+
+/* Build a balanced tree out of the sorted objects. A tree this balanced
+ * is a valid weak AVL tree as well, with ranks equal to heights.
+ */
+static struct bstree_node *spill_build_(struct bstree *tree,
+        const struct bstree_small *array, int lo, int hi)
+{
+    struct bstree_node *node;
+    int mid;
+    if (lo == hi) {
+        return NULL;
+    }
+    mid = lo + (hi - lo) / 2;
+    /* Small trees are never string trees, the object is its own key */
+    node = new_node_(tree, array->objects[mid], array->objects[mid]);
+    node->count = array->counts[mid];
+    node->left = spill_build_(tree, array, lo, mid);
+    node->right = spill_build_(tree, array, mid + 1, hi);
+    node->height = 1 + MAX(height_(node->left), height_(node->right));
+    return node;
+}
+
+/* Move the objects of a small tree into nodes, the tree is like any other
+ * from then on.
+ */
+static void spill_(struct bstree *tree)
+{
+    struct bstree_small array = tree->array;
+    int n = tree->size;
+    tree->small = 0;
+    tree->size = 0;
+    tree->slab = NULL;
+    tree->free_nodes = NULL;
+    tree->root = spill_build_(tree, &array, 0, n);
+    tree->min = get_min_(tree->root);
+    tree->max = get_max_(tree->root);
+}
+
+/* Insert into a small tree. Returns false if there was no room, the tree
+ * is not small anymore then, and the object is still to be inserted.
+ */
+static int small_insert_(struct bstree *tree, void *object, int replace)
+{
+    int i, found;
+    i = small_find_(tree, object, &found);
+    if (found) {
+        merge_(tree->ops, &tree->array.objects[i], &tree->array.counts[i],
+                object, replace);
+        return 1;
+    }
+    if (tree->size == SMALL_CAPACITY) {
+        spill_(tree);
+        return 0;
+    }
+    small_insert_at_(tree, i, object);
+    return 1;
+}
+
+static void small_remove_(struct bstree *tree, const void *key,
+        void (*free_object)(void *object))
+{
+    void *object;
+    int i, found;
+    i = small_find_(tree, key, &found);
+    if (!found) {
+        return;
+    }
+    object = tree->array.objects[i];
+    small_remove_at_(tree, i);
+    if (free_object) {
+        free_object(object);
+    }
+}
+
+/* Same as pop_, for small trees.
+ */
+static void *small_pop_(struct bstree *tree, int max, int *removed)
+{
+    void *object;
+    int i = max ? tree->size - 1 : 0;
+    if (!tree->size) {
+        return NULL;
+    }
+    object = tree->array.objects[i];
+    if (--tree->array.counts[i] == 0) {
+        small_remove_at_(tree, i);
+        *removed = 1;
+    }
+    return object;
+}
+
+/* Put the indices of the objects from lo to hi (not included) in 'order'
+ * at *at, in the given order of the tree spill_build_ would make of them.
+ * Small trees are traversed as that tree, so that spilling one does not
+ * change what a traversal sees.
+ */
+static void small_order_(int lo, int hi, enum bstree_order order,
+        int *indices, int *at)
+{
+    int mid;
+    if (lo == hi) {
+        return;
+    }
+    mid = lo + (hi - lo) / 2;
+    if (order == BSTREE_PREORDER) {
+        indices[(*at)++] = mid;
+    }
+    small_order_(lo, mid, order, indices, at);
+    if (order == BSTREE_INORDER) {
+        indices[(*at)++] = mid;
+    }
+    small_order_(mid + 1, hi, order, indices, at);
+    if (order == BSTREE_POSTORDER) {
+        indices[(*at)++] = mid;
+    }
+}
+
+static int small_traverse_(const struct bstree *tree, enum bstree_order order,
+        int use_count, void *it_data,
+        int (*operation)(void *object, void *it_data))
+{
+    int indices[SMALL_CAPACITY];
+    int i, j, n = 0;
+    small_order_(0, tree->size, order, indices, &n);
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < (use_count ? tree->array.counts[indices[i]] : 1);
+                j++) {
+            if (operation(tree->array.objects[indices[i]], it_data)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Same as traverse_chunks_, for small trees.
+ */
+static int small_traverse_chunks_(const struct bstree *tree,
+        enum bstree_order order, struct chunk_buffer *buf)
+{
+    void *objects[SMALL_CAPACITY];
+    int counts[SMALL_CAPACITY];
+    int indices[SMALL_CAPACITY];
+    int i, n = 0;
+    small_order_(0, tree->size, order, indices, &n);
+    for (i = 0; i < n; i++) {
+        objects[i] = tree->array.objects[indices[i]];
+        counts[i] = tree->array.counts[indices[i]];
+    }
+    return chunk_put_run_(buf, objects, counts, n);
+}
+
+/* Height of the tree spill_build_ would make of the objects.
+ */
+static int small_height_(const struct bstree *tree)
+{
+    int n, height = -1;
+    for (n = tree->size; n; n >>= 1) {
+        height++;
+    }
+    return height;
+}
+
+/* Write-ahead log
+ */
+
+/* How long the flusher lets records pile up before writing them out, so
+ * that they share one sync, unless someone is waiting for them.
+ */
+#define WAL_GROUP_NS 2000000L
+
+/* Records that are written out right away once there are this many bytes
+ * of them, and the size of the writes making up a snapshot.
+ */
+#define WAL_FLUSH_BYTES (1 << 20)
+
+/* The log is checkpointed once it grows past this, and past twice the
+ * size of the snapshot it starts with.
+ */
+#define WAL_CHECKPOINT_BYTES (4 << 20)
+
+#define WAL_CHUNK 256
+
+/* Every log starts with this, and then goes on with records, each being:
+ * the operation (one byte), the length of the object (varint), the count
+ * for snapshot records only (varint), the encoded object and a checksum
+ * of all of the above (4 bytes, little-endian). A snapshot of the tree is
+ * written in order right after the start by every checkpoint, the other
+ * records tell what has been done to the tree since.
+ */
+static const char wal_magic_[8] = "BSTWAL1\n";
+
+enum wal_op {
+    WAL_SNAPSHOT,
+    WAL_INSERT,
+    WAL_REPLACE,
+    WAL_REMOVE,
+    WAL_RELEASE,
+    /* One count taken by bstree_pop_min or bstree_pop_max */
+    WAL_POP
+};
+
+struct wal_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct bstree_wal {
+    int fd;
+    char *path;
+    size_t (*encode)(const void *object, void *buf, size_t cap);
+    void *(*decode)(const void *buf, size_t len);
+    /* The last object encoded, by the thread using the tree */
+    struct wal_buf scratch;
+    /* Bytes in the log, and in the snapshot it starts with */
+    size_t log_bytes;
+    size_t snapshot_bytes;
+    pthread_t flusher;
+    pthread_mutex_t lock;
+    /* Signalled when there is something for the flusher to do */
+    pthread_cond_t work;
+    /* Signalled when the flusher is done with a write */
+    pthread_cond_t done;
+    /* Records not written yet, and the ones the flusher is writing */
+    struct wal_buf pending;
+    struct wal_buf writing;
+    /* Number of records appended so far, and of those known to be on disk */
+    unsigned long appended;
+    unsigned long synced;
+    int waiting;
+    int busy;
+    int stop;
+    /* errno of the first failed write since the last checkpoint */
+    int error;
+};
+
+/* A record read back from the log. */
+struct wal_record {
+    void *object;
+    enum wal_op op;
+    int count;
+};
+
+static void buf_reserve_(struct wal_buf *buf, size_t n)
+{
+    if (buf->len + n <= buf->cap) {
+        return;
+    }
+    buf->cap = MAX(buf->cap * 2, buf->len + n);
+    buf->data = realloc(buf->data, buf->cap);
+}
+
+static void buf_put_varint_(struct wal_buf *buf, size_t value)
+{
+    while (value >= 0x80) {
+        buf->data[buf->len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf->data[buf->len++] = (unsigned char)value;
+}
+
+/* Read a varint, returns NULL if it does not end before 'end'. */
+static const unsigned char *get_varint_(const unsigned char *p,
+        const unsigned char *end, size_t *value)
+{
+    int shift = 0;
+    *value = 0;
+    while (p < end && shift < 64) {
+        *value |= (size_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+/* 32-bit FNV-1a */
+static uint32_t checksum_(const unsigned char *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    while (len--) {
+        hash = (hash ^ *data++) * 16777619u;
+    }
+    return hash;
+}
+
+static int write_all_(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t n;
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Encode the object into the scratch buffer of the log, returns its
+ * length.
+ */
+static size_t wal_encode_(struct bstree_wal *wal, const void *object)
+{
+    size_t len = wal->encode(object, wal->scratch.data, wal->scratch.cap);
+    if (len > wal->scratch.cap) {
+        buf_reserve_(&wal->scratch, len);
+        len = wal->encode(object, wal->scratch.data, wal->scratch.cap);
+    }
+    return len;
+}
+
+/* Append a record of the object just encoded to the buffer. Returns the
+ * size of the record.
+ */
+static size_t wal_put_(struct bstree_wal *wal, struct wal_buf *buf,
+        enum wal_op op, int count, size_t len)
+{
+    size_t start = buf->len;
+    uint32_t sum;
+    int i;
+    buf_reserve_(buf, 1 + 10 + 10 + len + 4);
+    buf->data[buf->len++] = (unsigned char)op;
+    buf_put_varint_(buf, len);
+    if (op == WAL_SNAPSHOT) {
+        buf_put_varint_(buf, count);
+    }
+    memcpy(buf->data + buf->len, wal->scratch.data, len);
+    buf->len += len;
+    sum = checksum_(buf->data + start, buf->len - start);
+    for (i = 0; i < 4; i++) {
+        buf->data[buf->len++] = (unsigned char)(sum >> (8 * i));
+    }
+    return buf->len - start;
+}
+
+static void *wal_flusher_main_(void *arg)
+{
+    struct bstree_wal *wal = arg;
+    struct wal_buf tmp;
+    struct timespec deadline;
+    unsigned long target;
+    int fd, error;
+    pthread_mutex_lock(&wal->lock);
+    for (;;) {
+        while (!wal->pending.len && !wal->stop) {
+            pthread_cond_wait(&wal->work, &wal->lock);
+        }
+        if (!wal->pending.len) {
+            break;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAL_GROUP_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!wal->waiting && !wal->stop &&
+                wal->pending.len && wal->pending.len < WAL_FLUSH_BYTES &&
+                pthread_cond_timedwait(&wal->work, &wal->lock,
+                    &deadline) != ETIMEDOUT) {
+            ;
+        }
+        /* A checkpoint may have taken them meanwhile */
+        if (!wal->pending.len) {
+            continue;
+        }
+        tmp = wal->writing;
+        wal->writing = wal->pending;
+        wal->pending = tmp;
+        wal->pending.len = 0;
+        target = wal->appended;
+        fd = wal->fd;
+        wal->busy = 1;
+        pthread_mutex_unlock(&wal->lock);
+        error = 0;
+        if (write_all_(fd, wal->writing.data, wal->writing.len) ||
+                fdatasync(fd)) {
+            error = errno;
+        }
+        pthread_mutex_lock(&wal->lock);
+        wal->busy = 0;
+        if (error) {
+            if (!wal->error) {
+                wal->error = error;
+            }
+        } else if (!wal->error) {
+            wal->synced = target;
+        }
+        pthread_cond_broadcast(&wal->done);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return NULL;
+}
+
+/* Make the rename of the log durable by syncing its directory. */
+static void sync_dir_(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir;
+    int fd;
+    if (!slash) {
+        dir = strdup(".");
+    } else {
+        dir = strndup(path, slash == path ? 1 : slash - path);
+    }
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+struct wal_snapshot {
+    struct bstree_wal *wal;
+    struct wal_buf buf;
+    int fd;
+    size_t bytes;
+};
+
+static int wal_snapshot_chunk_(void **objects, int *counts, int n,
+        void *it_data)
+{
+    struct wal_snapshot *snap = it_data;
+    int i;
+    for (i = 0; i < n; i++) {
+        snap->bytes += wal_put_(snap->wal, &snap->buf, WAL_SNAPSHOT,
+                counts[i], wal_encode_(snap->wal, objects[i]));
+    }
+    if (snap->buf.len >= WAL_FLUSH_BYTES) {
+        if (write_all_(snap->fd, snap->buf.data, snap->buf.len)) {
+            return 1;
+        }
+        snap->buf.len = 0;
+    }
+    return 0;
+}
+
+/* Write a snapshot of the tree into a new log and put it in place of the
+ * old one. The records not written yet are dropped, the snapshot has
+ * them all. Returns -1 if the new log could not be made, the old one is
+ * kept then.
+ */
+static int wal_checkpoint_(struct bstree *tree)
+{
+    struct bstree_wal *wal = tree->wal;
+    struct wal_snapshot snap = { wal, { NULL, 0, 0 }, -1, sizeof wal_magic_ };
+    void *objects[WAL_CHUNK];
+    int counts[WAL_CHUNK];
+    char *tmp_path;
+    int error = 0;
+    tmp_path = malloc(strlen(wal->path) + sizeof ".tmp");
+    sprintf(tmp_path, "%s.tmp", wal->path);
+    snap.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (snap.fd < 0) {
+        free(tmp_path);
+        return -1;
+    }
+    buf_reserve_(&snap.buf, sizeof wal_magic_);
+    memcpy(snap.buf.data, wal_magic_, sizeof wal_magic_);
+    snap.buf.len = sizeof wal_magic_;
+    if (bstree_traverse_chunks(tree, BSTREE_INORDER, objects, counts,
+                WAL_CHUNK, &snap, wal_snapshot_chunk_) ||
+            write_all_(snap.fd, snap.buf.data, snap.buf.len) ||
+            fsync(snap.fd)) {
+        error = errno;
+    }
+    free(snap.buf.data);
+    if (!error) {
+        pthread_mutex_lock(&wal->lock);
+        while (wal->busy) {
+            pthread_cond_wait(&wal->done, &wal->lock);
+        }
+        if (rename(tmp_path, wal->path)) {
+            error = errno;
+        } else {
+            if (wal->fd >= 0) {
+                close(wal->fd);
+            }
+            wal->fd = snap.fd;
+            wal->pending.len = 0;
+            wal->synced = wal->appended;
+            wal->error = 0;
+            pthread_cond_broadcast(&wal->done);
+        }
+        pthread_mutex_unlock(&wal->lock);
+    }
+    if (error) {
+        close(snap.fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        /* Do not try again before the log grows as much once more */
+        wal->snapshot_bytes = wal->log_bytes;
+        errno = error;
+        return -1;
+    }
+    free(tmp_path);
+    sync_dir_(wal->path);
+    wal->log_bytes = snap.bytes;
+    wal->snapshot_bytes = snap.bytes;
+    return 0;
+}
+
+/* Log what is about to be done to the tree with the object (or key). */
+static void wal_log_(struct bstree *tree, enum wal_op op, const void *object)
+{
+    struct bstree_wal *wal = tree->wal;
+    size_t len;
+    if (wal->log_bytes >= WAL_CHECKPOINT_BYTES &&
+            wal->log_bytes / 2 >= wal->snapshot_bytes) {
+        wal_checkpoint_(tree);
+    }
+    len = wal_encode_(wal, object);
+    pthread_mutex_lock(&wal->lock);
+    len = wal_put_(wal, &wal->pending, op, 0, len);
+    wal->appended++;
+    if (wal->pending.len == len || wal->pending.len >= WAL_FLUSH_BYTES) {
+        pthread_cond_signal(&wal->work);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    wal->log_bytes += len;
+}
+
+/* Read the whole log, a missing one is empty. */
+static int wal_read_(const char *path, unsigned char **data, size_t *len)
+{
+    struct stat st;
+    ssize_t n;
+    int fd = open(path, O_RDONLY);
+    *data = NULL;
+    *len = 0;
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    *data = malloc(st.st_size ? st.st_size : 1);
+    while (*len < (size_t)st.st_size) {
+        n = read(fd, *data + *len, st.st_size - *len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        *len += n;
+    }
+    close(fd);
+    return 0;
+}
+
+static void discard_(const struct bstree_ops *ops, void *object)
+{
+    if (ops->free_object) {
+        ops->free_object(object);
+    }
+}
+
+/* Whether there is nothing but zeros in [p, end), as a file extended by
+ * a crash before its data was written reads.
+ */
+static int wal_zeros_(const unsigned char *p, const unsigned char *end)
+{
+    while (p < end && !*p) {
+        p++;
+    }
+    return p == end;
+}
+
+/* Decode the records of the log into 'records', up to a torn one at the
+ * end, which is where a crash stopped the writing: one cut short by the
+ * end of the file, or whose checksum fails with nothing but zeros after
+ * it. Returns the number of records, or -1 if this is not a log (errno is
+ * EINVAL) or a record before the end is corrupt (errno is EILSEQ).
+ */
+static long wal_parse_(const struct bstree_ops *ops, struct bstree_wal *wal,
+        const unsigned char *data, size_t len, struct wal_record **records)
+{
+    const unsigned char *p, *q, *start, *end = data + len;
+    size_t n = 0, cap = 0, size, count;
+    uint32_t sum;
+    void *object;
+    int op, i, corrupt = 0;
+    *records = NULL;
+    if (!len) {
+        return 0;
+    }
+    if (len < sizeof wal_magic_ ||
+            memcmp(data, wal_magic_, sizeof wal_magic_)) {
+        errno = EINVAL;
+        return -1;
+    }
+    p = data + sizeof wal_magic_;
+    while (p < end) {
+        start = p;
+        op = *p++;
+        count = 1;
+        if (!(q = get_varint_(p, end, &size)) || (op == WAL_SNAPSHOT &&
+                    !(q = get_varint_(q, end, &count)))) {
+            /* Torn if it ran off the end rather than past 64 bits */
+            corrupt = end - p > 20;
+            break;
+        }
+        p = q;
+        if ((size_t)(end - p) < 4 || size > (size_t)(end - p) - 4) {
+            break;
+        }
+        sum = 0;
+        for (i = 0; i < 4; i++) {
+            sum |= (uint32_t)p[size + i] << (8 * i);
+        }
+        if (sum != checksum_(start, p + size - start)) {
+            corrupt = !wal_zeros_(p + size + 4, end);
+            break;
+        }
+        /* Written whole, so anything wrong with it is not a crash's doing */
+        if (op > WAL_POP || !(object = wal->decode(p, size))) {
+            corrupt = 1;
+            break;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            *records = realloc(*records, cap * sizeof **records);
+        }
+        (*records)[n].object = object;
+        (*records)[n].op = op;
+        (*records)[n].count = (int)count;
+        n++;
+        p += size + 4;
+    }
+    if (corrupt) {
+        while (n) {
+            discard_(ops, (*records)[--n].object);
+        }
+        free(*records);
+        *records = NULL;
+        errno = EILSEQ;
+        return -1;
+    }
+    return n;
+}
+
+static int compare_objects_(const struct bstree_ops *ops, const void *lhs,
+        const void *rhs)
+{
+    if (ops->key) {
+        return strcmp(ops->key(lhs), ops->key(rhs));
+    }
+    return ops->compare_object(lhs, rhs);
+}
+
+/* Stable merge sort of the records by their objects, so that what was
+ * done to each key stays in the order it was done. Runs in linear time on
+ * the snapshot, which is sorted already.
+ */
+static void wal_sort_(const struct bstree_ops *ops, struct wal_record *records,
+        struct wal_record *tmp, size_t n)
+{
+    size_t mid = n / 2, i = 0, j = mid, k = 0;
+    if (n < 2) {
+        return;
+    }
+    wal_sort_(ops, records, tmp, mid);
+    wal_sort_(ops, records + mid, tmp, n - mid);
+    if (compare_objects_(ops, records[mid - 1].object,
+                records[mid].object) <= 0) {
+        return;
+    }
+    while (i < mid && j < n) {
+        if (compare_objects_(ops, records[j].object,
+                    records[i].object) < 0) {
+            tmp[k++] = records[j++];
+        } else {
+            tmp[k++] = records[i++];
+        }
+    }
+    while (i < mid) {
+        tmp[k++] = records[i++];
+    }
+    memcpy(records, tmp, k * sizeof *records);
+}
+
+/* Play the sorted records of each key in turn, the way the tree would
+ * have, and leave what the tree ends up with at the start of 'records',
+ * one per key, with its count. Returns how many there are.
+ */
+static size_t wal_fold_(const struct bstree_ops *ops,
+        struct wal_record *records, size_t n)
+{
+    size_t i = 0, j, end, k = 0;
+    void *object;
+    int count;
+    while (i < n) {
+        for (end = i + 1; end < n && compare_objects_(ops, records[i].object,
+                    records[end].object) == 0; end++) {
+            ;
+        }
+        object = NULL;
+        count = 0;
+        for (j = i; j < end; j++) {
+            switch (records[j].op) {
+            case WAL_SNAPSHOT:
+            case WAL_INSERT:
+            case WAL_REPLACE:
+                if (!object) {
+                    object = records[j].object;
+                    count = records[j].count;
+                } else if (records[j].op == WAL_REPLACE) {
+                    discard_(ops, object);
+                    object = records[j].object;
+                } else {
+                    count += records[j].count;
+                    discard_(ops, records[j].object);
+                }
+                break;
+            case WAL_POP:
+                discard_(ops, records[j].object);
+                if (object && --count == 0) {
+                    discard_(ops, object);
+                    object = NULL;
+                }
+                break;
+            default:
+                discard_(ops, records[j].object);
+                if (object) {
+                    discard_(ops, object);
+                    object = NULL;
+                }
+            }
+        }
+        if (object) {
+            records[k].object = object;
+            records[k].count = count;
+            k++;
+        }
+        i = end;
+    }
+    return k;
+}
+
+/* Build a balanced tree of the sorted records in the slab, in order.
+ * A tree this balanced is a valid weak AVL tree as well, with ranks equal
+ * to heights.
+ */
+static struct bstree_node *build_(struct bstree *tree,
+        struct bstree_slab *slab, const struct wal_record *records,
+        size_t lo, size_t hi)
+{
+    struct bstree_str_probe probe;
+    struct bstree_node *node;
+    size_t mid;
+    if (lo == hi) {
+        return NULL;
+    }
+    mid = lo + (hi - lo) / 2;
+    node = slab_node_(slab, mid);
+    node->object = records[mid].object;
+    node->count = records[mid].count;
+    node->left = build_(tree, slab, records, lo, mid);
+    node->right = build_(tree, slab, records, mid + 1, hi);
+    node->height = 1 + MAX(height_(node->left), height_(node->right));
+    if (tree->ops->key) {
+        probe_(tree->ops, node->object, &probe);
+        *str_key_(node) = probe.key;
+    }
+    update_(tree->ops, node);
+    if (tree->index) {
+        index_add_(tree->index, tree->ops, node);
+    }
+    return node;
+}
+
+/* Build a balanced tree of fat nodes out of the sorted records, 'nodes'
+ * of them in all, each holding an even share of the n records. The share
+ * is at least half of FAT_CAPACITY, so none of them is sparse enough to be
+ * merged by fat_remove_.
+ */
+static struct bstree_fat_node *fat_build_(const struct wal_record *records,
+        size_t n, size_t nodes, size_t lo, size_t hi)
+{
+    struct bstree_fat_node *node;
+    size_t mid, first, i;
+    if (lo == hi) {
+        return NULL;
+    }
+    mid = lo + (hi - lo) / 2;
+    first = mid * n / nodes;
+    node = malloc(sizeof *node);
+    node->n = (int)((mid + 1) * n / nodes - first);
+    for (i = 0; i < (size_t)node->n; i++) {
+        node->objects[i] = records[first + i].object;
+        node->counts[i] = records[first + i].count;
+    }
+    node->left = fat_build_(records, n, nodes, lo, mid);
+    node->right = fat_build_(records, n, nodes, mid + 1, hi);
+    node->height = 1 + MAX(fat_height_(node->left), fat_height_(node->right));
+    return node;
+}
+
+/* Fill the empty tree with the sorted records, all at once.
+ */
+static void wal_load_(struct bstree *tree, const struct wal_record *records,
+        size_t n)
+{
+    if (!n) {
+        return;
+    }
+    if (tree->small) {
+        spill_(tree);
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        tree->fat_root = fat_build_(records, n,
+                (n + FAT_CAPACITY - 1) / FAT_CAPACITY, 0,
+                (n + FAT_CAPACITY - 1) / FAT_CAPACITY);
+        return;
+    }
+    tree->slab = malloc(sizeof *tree->slab + n * node_size_(tree->ops));
+    tree->slab->n = n;
+    tree->slab->stride = node_size_(tree->ops);
+    tree->root = build_(tree, tree->slab, records, 0, n);
+    tree->size = (int)n;
+    tree->min = slab_node_(tree->slab, 0);
+    tree->max = slab_node_(tree->slab, n - 1);
+}
+
+/* Empty the tree wal_load_ filled again, 'small' is whether it was small
+ * before.
+ */
+static void wal_unload_(struct bstree *tree, int small)
+{
+    if (tree->ops->engine == ENGINE_FAT) {
+        fat_destroy_(tree->fat_root, tree->ops);
+        tree->fat_root = NULL;
+        return;
+    }
+    destroy_(tree->root, tree->ops, tree->slab);
+    free(tree->slab);
+    if (tree->index) {
+        index_destroy_(tree->index);
+        tree->index = index_new_(4);
+    }
+    tree->root = NULL;
+    tree->min = NULL;
+    tree->max = NULL;
+    tree->slab = NULL;
+    tree->free_nodes = NULL;
+    tree->size = 0;
+    tree->small = small;
+}
+
+/* Bounded trees
+ */
+
+/* Insert into a bounded tree, see bstree_new_bounded. An object less than
+ * the least one of a full tree is not taken in. Returns what the tree let
+ * go of, either that object or the least one, evicted to make room, NULL
+ * if nothing.
+ */
+static void *insert_bounded_(struct bstree *tree, void *object, int replace)
+{
+    struct bstree_str_probe probe;
+    struct bstree_node *node;
+    const void *key = probe_(tree->ops, object, &probe);
+    if (tree->size >= tree->capacity &&
+            (!tree->min || compare_(tree->ops, key, tree->min) < 0)) {
+        return object;
+    }
+    if (tree->wal) {
+        wal_log_(tree, replace ? WAL_REPLACE : WAL_INSERT, object);
+    }
+    tree->root = insert_(tree, tree->root, object, key, EDGE_MIN | EDGE_MAX,
+            replace);
+    if (tree->size <= tree->capacity) {
+        return NULL;
+    }
+    if (tree->wal) {
+        wal_log_(tree, WAL_RELEASE, tree->min->object);
+    }
+    tree->root = detach_min_(tree->ops, tree->root, &node);
+    tree->min = get_min_(tree->root);
+    object = node->object;
+    free_node_(tree, node);
+    return object;
+}
+
+/* Interface functions
+ */
+
+/* Make a tree with the given ops, shared with the other trees having the
+ * same ones.
+ */
+static struct bstree *new_(const struct bstree_ops *ops)
+{
+    struct bstree *tree;
     tree = malloc(sizeof(*tree));
+    tree->ops = ops_get_(ops);
     tree->root = NULL;
-    tree->ops = malloc(sizeof(*tree->ops));
-    tree->ops->compare_object = compare_object;
-    tree->ops->free_object = free_object;
+    tree->min = NULL;
+    tree->max = NULL;
+    tree->slab = NULL;
+    tree->free_nodes = NULL;
+    tree->index = NULL;
+    tree->wal = NULL;
+    tree->size = 0;
+    tree->capacity = 0;
+    tree->small = 0;
+    return tree;
+}
+
+struct bstree *bstree_new(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree_ops ops;
+    struct bstree *tree;
+    ops_init_(&ops, compare_object, free_object, ENGINE_BINARY, POLICY_AVL);
+    tree = new_(&ops);
+    tree->small = 1;
+    return tree;
+}
+
+struct bstree *bstree_new_fat(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree_ops ops;
+    ops_init_(&ops, compare_object, free_object, ENGINE_FAT, POLICY_AVL);
+    return new_(&ops);
+}
+
+struct bstree *bstree_new_hashed(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        unsigned long (*hash_object)(const void *object),
+        void (*free_object)(void *object))
+{
+    struct bstree_ops ops;
+    struct bstree *tree;
+    ops_init_(&ops, compare_object, free_object, ENGINE_BINARY, POLICY_AVL);
+    ops.hash_object = hash_object;
+    tree = new_(&ops);
+    tree->index = index_new_(4);
+    return tree;
+}
+
+struct bstree *bstree_new_augmented(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object), size_t agg_size,
+        void (*leaf)(void *agg, const void *object, int count),
+        void (*combine)(void *agg, const void *lhs, const void *rhs))
+{
+    struct bstree_ops ops;
+    ops_init_(&ops, compare_object, free_object, ENGINE_BINARY, POLICY_AVL);
+    ops.agg_size = agg_size;
+    ops.leaf = leaf;
+    ops.combine = combine;
+    return new_(&ops);
+}
+
+struct bstree *bstree_new_str(const char *(*key)(const void *object),
+        void (*free_object)(void *object))
+{
+    struct bstree_ops ops;
+    ops_init_(&ops, NULL, free_object, ENGINE_BINARY, POLICY_AVL);
+    ops.key = key;
+    return new_(&ops);
+}
+
+struct bstree *bstree_new_bounded(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object), int k)
+{
+    struct bstree_ops ops;
+    struct bstree *tree;
+    /* A capacity of 0 would mean the tree is not bounded at all */
+    if (k < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ops_init_(&ops, compare_object, free_object, ENGINE_BINARY, POLICY_AVL);
+    tree = new_(&ops);
+    tree->capacity = k;
+    return tree;
+}
+
+struct bstree *bstree_new_wavl(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree_ops ops;
+    struct bstree *tree;
+    ops_init_(&ops, compare_object, free_object, ENGINE_BINARY, POLICY_WAVL);
+    tree = new_(&ops);
+    tree->small = 1;
     return tree;
 }
 
 void bstree_destroy(struct bstree *tree)
 {
-    destroy_(tree->root, tree->ops);
-    free(tree->ops);
+    int i;
+    bstree_wal_close(tree);
+    if (tree->small) {
+        for (i = 0; i < tree->size && tree->ops->free_object; i++) {
+            tree->ops->free_object(tree->array.objects[i]);
+        }
+    } else if (tree->ops->engine == ENGINE_FAT) {
+        fat_destroy_(tree->fat_root, tree->ops);
+    } else {
+        destroy_(tree->root, tree->ops, tree->slab);
+        free(tree->slab);
+    }
+    index_destroy_(tree->index);
+    ops_put_(tree->ops);
+    free(tree);
+}
+
+void bstree_destroy_async(struct bstree *tree)
+{
+    struct reclaim_job *job;
+    if (tree->small) {
+        /* Nothing worth a thread */
+        bstree_destroy(tree);
+        return;
+    }
+    job = malloc(sizeof *job);
+    bstree_wal_close(tree);
+    job->engine = tree->ops->engine;
+    if (job->engine == ENGINE_FAT) {
+        job->fat_root = tree->fat_root;
+    } else {
+        job->root = tree->root;
+    }
+    job->ops = tree->ops;
+    job->slab = tree->slab;
+    index_destroy_(tree->index);
     free(tree);
+    if (!reclaim_async_(job)) {
+        reclaim_(job);
+    }
+}
+
+size_t bstree_compact(struct bstree *tree)
+{
+    struct bstree_slab *slab;
+    size_t n, stride, used, i = 0, freed = 0;
+    if (tree->small || tree->ops->engine == ENGINE_FAT) {
+        return 0;
+    }
+    n = tree->size;
+    stride = node_size_(tree->ops);
+    slab = malloc(sizeof *slab + n * stride);
+    slab->n = n;
+    slab->stride = stride;
+    tree->root = compact_(tree, tree->root, slab, &i, &freed);
+    if (tree->slab) {
+        freed += alloc_size_(tree->slab,
+                sizeof *tree->slab + tree->slab->n * stride);
+        free(tree->slab);
+    }
+    tree->slab = slab;
+    tree->free_nodes = NULL;
+    tree->min = n ? slab_node_(slab, 0) : NULL;
+    tree->max = n ? slab_node_(slab, n - 1) : NULL;
+    used = alloc_size_(slab, sizeof *slab + n * stride);
+    return freed > used ? freed - used : 0;
+}
+
+void bstree_reclaim_wait(void)
+{
+    pthread_mutex_lock(&reclaimer.lock);
+    while (reclaimer.pending) {
+        pthread_cond_wait(&reclaimer.idle, &reclaimer.lock);
+    }
+    pthread_mutex_unlock(&reclaimer.lock);
+}
+
+int bstree_wal_open(struct bstree *tree, const char *path,
+        size_t (*encode)(const void *object, void *buf, size_t cap),
+        void *(*decode)(const void *buf, size_t len))
+{
+    struct bstree_wal *wal;
+    struct wal_record *records, *tmp;
+    unsigned char *data;
+    size_t len;
+    long n;
+    int small = tree->small, error;
+    if (tree->wal || bstree_size(tree) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (wal_read_(path, &data, &len)) {
+        return -1;
+    }
+    wal = malloc(sizeof *wal);
+    wal->fd = -1;
+    wal->path = strdup(path);
+    wal->encode = encode;
+    wal->decode = decode;
+    wal->scratch.data = NULL;
+    wal->scratch.len = 0;
+    wal->scratch.cap = 0;
+    wal->log_bytes = 0;
+    wal->snapshot_bytes = 0;
+    n = wal_parse_(tree->ops, wal, data, len, &records);
+    free(data);
+    if (n < 0) {
+        free(wal->path);
+        free(wal);
+        return -1;
+    }
+    tmp = malloc(n * sizeof *tmp);
+    wal_sort_(tree->ops, records, tmp, n);
+    free(tmp);
+    wal_load_(tree, records, wal_fold_(tree->ops, records, n));
+    free(records);
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->work, NULL);
+    pthread_cond_init(&wal->done, NULL);
+    wal->pending.data = NULL;
+    wal->pending.len = 0;
+    wal->pending.cap = 0;
+    wal->writing = wal->pending;
+    wal->appended = 0;
+    wal->synced = 0;
+    wal->waiting = 0;
+    wal->busy = 0;
+    wal->stop = 0;
+    wal->error = 0;
+    tree->wal = wal;
+    /* Start over with a log holding just what we have read */
+    if (wal_checkpoint_(tree)) {
+        error = errno;
+    } else {
+        /* pthread_create returns the error instead of setting errno */
+        error = pthread_create(&wal->flusher, NULL, wal_flusher_main_, wal);
+    }
+    if (error) {
+        /* There is no flusher to wait for */
+        wal->flusher = pthread_self();
+        bstree_wal_close(tree);
+        wal_unload_(tree, small);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int bstree_wal_sync(struct bstree *tree)
+{
+    struct bstree_wal *wal = tree->wal;
+    unsigned long target;
+    int error;
+    if (!wal) {
+        return 0;
+    }
+    pthread_mutex_lock(&wal->lock);
+    target = wal->appended;
+    wal->waiting++;
+    pthread_cond_signal(&wal->work);
+    while (wal->synced < target && !wal->error) {
+        pthread_cond_wait(&wal->done, &wal->lock);
+    }
+    wal->waiting--;
+    error = wal->error;
+    pthread_mutex_unlock(&wal->lock);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int bstree_wal_checkpoint(struct bstree *tree)
+{
+    return tree->wal ? wal_checkpoint_(tree) : 0;
+}
+
+int bstree_wal_close(struct bstree *tree)
+{
+    struct bstree_wal *wal = tree->wal;
+    int error;
+    if (!wal) {
+        return 0;
+    }
+    pthread_mutex_lock(&wal->lock);
+    wal->stop = 1;
+    pthread_cond_signal(&wal->work);
+    pthread_mutex_unlock(&wal->lock);
+    if (!pthread_equal(wal->flusher, pthread_self())) {
+        pthread_join(wal->flusher, NULL);
+    }
+    error = wal->error;
+    if (wal->fd >= 0) {
+        close(wal->fd);
+    }
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->work);
+    pthread_cond_destroy(&wal->done);
+    free(wal->scratch.data);
+    free(wal->pending.data);
+    free(wal->writing.data);
+    free(wal->path);
+    free(wal);
+    tree->wal = NULL;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
 }
 
 void bstree_insert(struct bstree *tree, void *object)
 {
-    tree->root = insert_(tree->root, tree->ops, object);
+    struct bstree_str_probe probe;
+    struct bstree_node *node;
+    if (tree->capacity) {
+        object = insert_bounded_(tree, object, 0);
+        if (object && tree->ops->free_object) {
+            tree->ops->free_object(object);
+        }
+        return;
+    }
+    if (tree->wal) {
+        wal_log_(tree, WAL_INSERT, object);
+    }
+    if (tree->small && small_insert_(tree, object, 0)) {
+        return;
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        tree->fat_root = fat_insert_(tree->fat_root, tree->ops, object, 0);
+        return;
+    }
+    if (tree->index && (node = index_find_(tree->index, tree->ops, object))) {
+        merge_(tree->ops, &node->object, &node->count, object, 0);
+        return;
+    }
+    tree->root = insert_(tree, tree->root, object,
+            probe_(tree->ops, object, &probe), EDGE_MIN | EDGE_MAX, 0);
+}
+
+void bstree_append(struct bstree *tree, void *object)
+{
+    struct bstree_str_probe probe;
+    struct bstree_node *node;
+    const void *key;
+    int cmp;
+    if (tree->ops->engine == ENGINE_FAT || tree->small || !tree->root ||
+            tree->capacity) {
+        bstree_insert(tree, object);
+        return;
+    }
+    key = probe_(tree->ops, object, &probe);
+    cmp = compare_(tree->ops, key, tree->max);
+    if (cmp < 0 && compare_(tree->ops, key, tree->min) >= 0) {
+        bstree_insert(tree, object);
+        return;
+    }
+    if (tree->wal) {
+        wal_log_(tree, WAL_INSERT, object);
+    }
+    if (cmp > 0) {
+        node = new_node_(tree, object, key);
+        tree->root = insert_max_(tree->ops, tree->root, node);
+        tree->max = node;
+        return;
+    }
+    if (cmp == 0) {
+        merge_(tree->ops, &tree->max->object, &tree->max->count, object, 0);
+        update_spine_(tree->ops, tree->root, 1);
+        return;
+    }
+    node = new_node_(tree, object, key);
+    tree->root = insert_min_(tree->ops, tree->root, node);
+    tree->min = node;
+}
+
+void *bstree_insert_evict(struct bstree *tree, void *object)
+{
+    if (!tree->capacity) {
+        bstree_insert(tree, object);
+        return NULL;
+    }
+    return insert_bounded_(tree, object, 0);
 }
 
 void bstree_replace(struct bstree *tree, void *object)
 {
-    tree->root = replace_(tree->root, tree->ops, object);
+    struct bstree_str_probe probe;
+    struct bstree_node *node;
+    if (tree->capacity) {
+        object = insert_bounded_(tree, object, 1);
+        if (object && tree->ops->free_object) {
+            tree->ops->free_object(object);
+        }
+        return;
+    }
+    if (tree->wal) {
+        wal_log_(tree, WAL_REPLACE, object);
+    }
+    if (tree->small && small_insert_(tree, object, 1)) {
+        return;
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        tree->fat_root = fat_insert_(tree->fat_root, tree->ops, object, 1);
+        return;
+    }
+    if (tree->index && (node = index_find_(tree->index, tree->ops, object))) {
+        merge_(tree->ops, &node->object, &node->count, object, 1);
+        return;
+    }
+    tree->root = insert_(tree, tree->root, object,
+            probe_(tree->ops, object, &probe), EDGE_MIN | EDGE_MAX, 1);
 }
 
 int bstree_traverse_inorder(const struct bstree *tree, void *it_data,
         int (*operation)(void *object, void *it_data))
 {
+    if (tree->small) {
+        return small_traverse_(tree, BSTREE_INORDER, 0, it_data, operation);
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        return fat_traverse_inorder_(tree->fat_root, 0, it_data, operation);
+    }
     return traverse_inorder_(tree->root, it_data, operation);
 }
 
 int bstree_traverse_preorder(const struct bstree *tree, void *it_data,
         int (*operation)(void *object, void *it_data))
 {
+    if (tree->small) {
+        return small_traverse_(tree, BSTREE_PREORDER, 0, it_data, operation);
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        return fat_traverse_preorder_(tree->fat_root, 0, it_data, operation);
+    }
     return traverse_preorder_(tree->root, it_data, operation);
 }
 
 int bstree_traverse_postorder(const struct bstree *tree, void *it_data,
         int (*operation)(void *object, void *it_data))
 {
+    if (tree->small) {
+        return small_traverse_(tree, BSTREE_POSTORDER, 0, it_data, operation);
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        return fat_traverse_postorder_(tree->fat_root, 0, it_data, operation);
+    }
     return traverse_postorder_(tree->root, it_data, operation);
 }
 
 int bstree_traverse_inorder_cnt(const struct bstree *tree, void *it_data,
         int (*operation)(void *object, void *it_data))
 {
+    if (tree->small) {
+        return small_traverse_(tree, BSTREE_INORDER, 1, it_data, operation);
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        return fat_traverse_inorder_(tree->fat_root, 1, it_data, operation);
+    }
     return traverse_inorder_cnt_(tree->root, it_data, operation);
 }
 
 int bstree_traverse_preorder_cnt(const struct bstree *tree, void *it_data,
         int (*operation)(void *object, void *it_data))
 {
+    if (tree->small) {
+        return small_traverse_(tree, BSTREE_PREORDER, 1, it_data, operation);
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        return fat_traverse_preorder_(tree->fat_root, 1, it_data, operation);
+    }
     return traverse_preorder_cnt_(tree->root, it_data, operation);
 }
 
 int bstree_traverse_postorder_cnt(const struct bstree *tree, void *it_data,
         int (*operation)(void *object, void *it_data))
 {
+    if (tree->small) {
+        return small_traverse_(tree, BSTREE_POSTORDER, 1, it_data, operation);
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        return fat_traverse_postorder_(tree->fat_root, 1, it_data, operation);
+    }
     return traverse_postorder_cnt_(tree->root, it_data, operation);
 }
 
+int bstree_traverse_chunks(const struct bstree *tree, enum bstree_order order,
+        void **objects, int *counts, int cap, void *it_data,
+        int (*operation)(void **objects, int *counts, int n, void *it_data))
+{
+    struct chunk_buffer buf = {
+        objects, counts, cap, 0, it_data, operation
+    };
+    int stopped;
+    if (cap < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (tree->small) {
+        stopped = small_traverse_chunks_(tree, order, &buf);
+    } else if (tree->ops->engine == ENGINE_FAT) {
+        stopped = fat_traverse_chunks_(tree->fat_root, order, &buf);
+    } else {
+        stopped = traverse_chunks_(tree->root, order, &buf);
+    }
+    if (stopped) {
+        return 1;
+    }
+    return buf.n > 0 && operation(objects, counts, buf.n, it_data);
+}
+
 int bstree_count(const struct bstree *tree, const void *key)
 {
-    return count_(tree->root, tree->ops, key);
+    struct bstree_str_probe probe;
+    if (tree->small) {
+        int i, found;
+        i = small_find_(tree, key, &found);
+        return found ? tree->array.counts[i] : 0;
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        struct bstree_fat_node *node;
+        int i;
+        node = fat_locate_(tree->fat_root, tree->ops, key, &i);
+        return node ? node->counts[i] : 0;
+    }
+    if (tree->index) {
+        struct bstree_node *node = index_find_(tree->index, tree->ops, key);
+        return node ? node->count : 0;
+    }
+    return count_(tree->root, tree->ops, probe_(tree->ops, key, &probe));
 }
 
 void *bstree_search(const struct bstree *tree, const void *key)
 {
-    return search_(tree->root, tree->ops, key);
+    struct bstree_str_probe probe;
+    if (tree->small) {
+        int i, found;
+        i = small_find_(tree, key, &found);
+        return found ? tree->array.objects[i] : NULL;
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        struct bstree_fat_node *node;
+        int i;
+        node = fat_locate_(tree->fat_root, tree->ops, key, &i);
+        return node ? node->objects[i] : NULL;
+    }
+    if (tree->index) {
+        struct bstree_node *node = index_find_(tree->index, tree->ops, key);
+        return node ? node->object : NULL;
+    }
+    return search_(tree->root, tree->ops, probe_(tree->ops, key, &probe));
+}
+
+int bstree_range_aggregate(const struct bstree *tree, const void *lo,
+        const void *hi, void *out)
+{
+    union {
+        max_align_t align;
+        unsigned char bytes[64];
+    } scratch;
+    struct range_agg r;
+    if (!tree->ops->combine) {
+        return 0;
+    }
+    r.ops = tree->ops;
+    r.out = out;
+    r.scratch = tree->ops->agg_size > sizeof scratch ?
+        malloc(tree->ops->agg_size) : &scratch;
+    r.have = 0;
+    range_(&r, tree->root, lo, hi);
+    if (r.scratch != &scratch) {
+        free(r.scratch);
+    }
+    return r.have;
 }
 
 void bstree_remove(struct bstree *tree, const void *key)
 {
-    tree->root = remove_(tree->root, tree->ops, key);
+    struct bstree_str_probe probe;
+    if (tree->wal) {
+        wal_log_(tree, WAL_REMOVE, key);
+    }
+    if (tree->small) {
+        small_remove_(tree, key, tree->ops->free_object);
+        return;
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        tree->fat_root = fat_remove_(tree->fat_root, tree->ops, key,
+                tree->ops->free_object);
+        return;
+    }
+    if (tree->index && !index_find_(tree->index, tree->ops, key)) {
+        return;
+    }
+    tree->root = remove_(tree, tree->root, probe_(tree->ops, key, &probe),
+            tree->ops->free_object);
+    refresh_fingers_(tree);
 }
 
 void bstree_release(struct bstree *tree, const void *key)
 {
-    struct bstree_ops tmp_ops = *tree->ops;
-    tmp_ops.free_object = NULL;
-    tree->root = remove_(tree->root, &tmp_ops, key);
+    struct bstree_str_probe probe;
+    if (tree->wal) {
+        wal_log_(tree, WAL_RELEASE, key);
+    }
+    if (tree->small) {
+        small_remove_(tree, key, NULL);
+        return;
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        tree->fat_root = fat_remove_(tree->fat_root, tree->ops, key, NULL);
+        return;
+    }
+    if (tree->index && !index_find_(tree->index, tree->ops, key)) {
+        return;
+    }
+    tree->root = remove_(tree, tree->root, probe_(tree->ops, key, &probe),
+            NULL);
+    refresh_fingers_(tree);
+}
+
+void *bstree_min(const struct bstree *tree)
+{
+    const struct bstree_fat_node *node;
+    if (tree->small) {
+        return tree->size ? tree->array.objects[0] : NULL;
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        node = fat_min_(tree->fat_root);
+        return node ? node->objects[0] : NULL;
+    }
+    return tree->min ? tree->min->object : NULL;
+}
+
+void *bstree_max(const struct bstree *tree)
+{
+    const struct bstree_fat_node *node;
+    if (tree->small) {
+        return tree->size ? tree->array.objects[tree->size - 1] : NULL;
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        node = fat_max_(tree->fat_root);
+        return node ? node->objects[node->n - 1] : NULL;
+    }
+    return tree->max ? tree->max->object : NULL;
+}
+
+/* Same as bstree_pop_min and bstree_pop_max, the greatest object if 'max'
+ * is set.
+ */
+static void *pop_end_(struct bstree *tree, int max, int *removed)
+{
+    void *object = max ? bstree_max(tree) : bstree_min(tree);
+    int gone = 0;
+    if (tree->wal && object) {
+        wal_log_(tree, WAL_POP, object);
+    }
+    if (tree->small) {
+        object = small_pop_(tree, max, &gone);
+    } else if (tree->ops->engine == ENGINE_FAT) {
+        if (tree->fat_root) {
+            tree->fat_root = fat_pop_(tree->fat_root, max, &object, &gone);
+        }
+    } else {
+        object = pop_(tree, max, &gone);
+    }
+    if (removed) {
+        *removed = gone;
+    }
+    return object;
+}
+
+void *bstree_pop_min(struct bstree *tree, int *removed)
+{
+    return pop_end_(tree, 0, removed);
+}
+
+void *bstree_pop_max(struct bstree *tree, int *removed)
+{
+    return pop_end_(tree, 1, removed);
 }
 
 int bstree_size(struct bstree *tree)
 {
-    return size_(tree->root);
+    if (tree->ops->engine == ENGINE_FAT) {
+        return fat_size_(tree->fat_root);
+    }
+    return tree->size;
 }
 
 int bstree_height(struct bstree *tree)
 {
+    if (tree->small) {
+        return small_height_(tree);
+    }
+    if (tree->ops->engine == ENGINE_FAT) {
+        return fat_height_(tree->fat_root);
+    }
+    if (tree->ops->policy == POLICY_WAVL) {
+        return real_height_(tree->root);
+    }
     return height_(tree->root);
 }
@@ -19,6 +19,8 @@
 #ifndef BSTREE_H
 #define BSTREE_H
 
+#include <stddef.h>
+
 /* Some notes:
  ** No duplicate keys will be present in the tree, inserting an already
  * existing value will increase the count held at the node. Functions that have
@@ -28,15 +30,118 @@
 
 struct bstree;
 
+enum bstree_order {
+    BSTREE_INORDER,
+    BSTREE_PREORDER,
+    BSTREE_POSTORDER
+};
+
+/* Make a tree ordered by compare_object. Trees made with the same
+ * functions share the table holding them. Trees made by this function and
+ * by bstree_new_wavl keep their first few objects in an array inside the
+ * tree itself, and only make nodes for them once there are more. This
+ * does not show: traversals and bstree_height see the balanced tree the
+ * nodes will make.
+ */
 struct bstree *bstree_new(
         int (*compare_object)(const void *lhs, const void *rhs),
         void (*free_object)(void *object));
 
+/* Like bstree_new, but the tree is built out of fat nodes, each holding
+ * a sorted run of up to 16 objects, and the balancing is done over those.
+ * A lookup then goes through far fewer nodes (and cache misses) on large
+ * trees. Every function below behaves the same for both kinds of trees,
+ * bstree_height gives the height of the tree of fat nodes.
+ */
+struct bstree *bstree_new_fat(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object));
+
+/* Like bstree_new, but the tree is balanced as a weak AVL (rank-balanced)
+ * tree. Insertions build the very same tree as bstree_new does, deletions
+ * are allowed to leave it less balanced, with its height still at most
+ * 2 log n. In return, rebalancing takes O(1) amortized rotations and
+ * usually stops early, which pays off in deletion-heavy workloads.
+ * bstree_height takes O(n) time on such a tree.
+ */
+struct bstree *bstree_new_wavl(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object));
+
+/* Like bstree_new, but the tree also keeps a hash index from keys to the
+ * nodes holding them. bstree_search and bstree_count are then answered by
+ * the index alone, without descending the tree, and so are the other
+ * functions when the key is already present (or absent, for removal).
+ * The index costs a few words per object, and one call to hash_object
+ * per lookup. Objects comparing equal must have equal hashes.
+ */
+struct bstree *bstree_new_hashed(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        unsigned long (*hash_object)(const void *object),
+        void (*free_object)(void *object));
+
+/* Like bstree_new, but every node also keeps an aggregate of its subtree,
+ * agg_size bytes long, so that bstree_range_aggregate can answer in
+ * O(log n) time. 'leaf' sets agg to the aggregate of one object, given its
+ * count, e.g. the object's payload times count for a sum. 'combine' sets
+ * agg to the aggregate of lhs followed by rhs. It must be associative (like
+ * sum, min or max), and agg may be the same as lhs or rhs.
+ */
+struct bstree *bstree_new_augmented(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object), size_t agg_size,
+        void (*leaf)(void *agg, const void *object, int count),
+        void (*combine)(void *agg, const void *lhs, const void *rhs));
+
+/* Like bstree_new, for objects ordered by a string key, as strcmp would
+ * order them. 'key' returns the string of an object, keys given to the
+ * functions below are objects as well. Every node caches the length and
+ * the first 8 bytes of its string, so most comparisons on the way down
+ * are a single integer comparison, and the string itself is only read
+ * when the first 8 bytes are the same.
+ */
+struct bstree *bstree_new_str(const char *(*key)(const void *object),
+        void (*free_object)(void *object));
+
+/* Like bstree_new, but the tree never holds more than k distinct objects,
+ * keeping the greatest ones, e.g. the top k items of a stream by score.
+ * When an insertion would make it k + 1, the least object is evicted in
+ * the same call. An object less than the least one of a full tree is
+ * turned away after a single comparison, without descending the tree.
+ * Evicted and turned away objects are passed to free_object, or handed
+ * back by bstree_insert_evict. bstree_append and bstree_replace keep the
+ * bound as well. Returns NULL with errno set to EINVAL if k is less
+ * than 1.
+ */
+struct bstree *bstree_new_bounded(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object), int k);
+
 /* Inserts the given object to the tree. If the object already exists,
  * increment the count.
  */
 void bstree_insert(struct bstree *tree, void *object);
 
+/* Inserts the given object like bstree_insert, for objects that usually go
+ * to either end of the tree, like timestamps or sequence numbers.
+ * The tree keeps fingers on its least and greatest nodes. An object
+ * greater than the greatest (or less than the least) one is found to be so
+ * after a single comparison with the finger, and is then linked in below
+ * it by walking down the right (left) spine of the tree without comparing
+ * anything. That still takes O(log n) steps for the walk and the
+ * rebalancing on the way back up, but saves the comparisons, which are
+ * what usually costs the most. Anything else falls back to bstree_insert,
+ * as does everything on trees made with bstree_new_fat.
+ */
+void bstree_append(struct bstree *tree, void *object);
+
+/* Inserts the given object like bstree_insert, but returns the object a
+ * tree made by bstree_new_bounded evicted or turned away, instead of
+ * passing it to free_object, NULL if there is none. It may be the given
+ * object. Always returns NULL for the other trees.
+ */
+void *bstree_insert_evict(struct bstree *tree, void *object);
+
 /* Like insert, but instead of incrementing the count for an already existing
  * object, it gets rid of the old object, replaces it with the given one.
  */
@@ -46,6 +151,73 @@ void bstree_replace(struct bstree *tree, void *object);
  */
 void bstree_destroy(struct bstree *tree);
 
+/* Destroy the tree in the background. The tree is gone as soon as this
+ * returns, its nodes are freed (and the objects passed to free_object)
+ * later on by a reclaimer thread, a slice at a time. free_object must
+ * therefore be safe to call from another thread.
+ */
+void bstree_destroy_async(struct bstree *tree);
+
+/* Wait until every tree given to bstree_destroy_async so far is freed,
+ * e.g. before exiting or before the objects' free_object goes away.
+ */
+void bstree_reclaim_wait(void);
+
+/* Move the nodes of the tree next to each other, in order, so that scans
+ * and nearby lookups touch fewer cache lines after a lot of churn. The tree
+ * can be used as before afterwards, nodes freed later on make room for the
+ * new ones. Takes O(n) time. Returns the number of bytes given back to the
+ * allocator, 0 for trees made by bstree_new_fat.
+ */
+size_t bstree_compact(struct bstree *tree);
+
+/* Keep a write-ahead log of the tree in the file at 'path', so that its
+ * contents survive a crash. The tree must be empty, it is filled with what
+ * an existing log at 'path' says it held, built all at once from the
+ * sorted objects rather than inserted one by one. Returns 0 on success,
+ * -1 with errno set if the log could not be read or written, the tree is
+ * left empty and is not logged then. A tree that is not empty, or is logged
+ * already, is left alone and errno is set to EINVAL. Only the end of the
+ * log may be torn by a crash: if a record before it is corrupt, or cannot
+ * be decoded, errno is set to EILSEQ and the log is not touched.
+ *
+ ** From then on, every bstree_insert, bstree_append, bstree_replace,
+ * bstree_remove, bstree_release and bstree_pop_min/pop_max is logged
+ * before it is done. 'encode' writes the bytes of an object (or a key
+ * given to bstree_remove and bstree_release) to buf if they fit in cap,
+ * and returns how many there are. 'decode' makes an object out of them
+ * again, objects it makes that do not end up in the tree are passed to
+ * free_object.
+ ** The log is written and synced by a background thread, a few
+ * milliseconds' worth of operations at a time, so that they share a
+ * single sync. bstree_wal_sync waits until everything logged so far is on
+ * disk.
+ ** Once the log gets much bigger than the tree, a snapshot of the tree is
+ * written to a new log put in place of the old one, as bstree_wal_checkpoint
+ * does.
+ */
+int bstree_wal_open(struct bstree *tree, const char *path,
+        size_t (*encode)(const void *object, void *buf, size_t cap),
+        void *(*decode)(const void *buf, size_t len));
+
+/* Wait until every operation logged so far is on disk. Returns -1 with
+ * errno set if writing the log failed, in which case nothing logged since
+ * the last checkpoint is known to be there.
+ */
+int bstree_wal_sync(struct bstree *tree);
+
+/* Write a snapshot of the tree to a new log and put it in place of the old
+ * one, which is all the operations logged so far need from then on.
+ * Takes O(n) time. Returns -1 with errno set on failure, the old log is
+ * kept then.
+ */
+int bstree_wal_checkpoint(struct bstree *tree);
+
+/* Write out what is left of the log and stop logging. bstree_destroy does
+ * this as well. Returns -1 with errno set if writing the log failed.
+ */
+int bstree_wal_close(struct bstree *tree);
+
 /* Traverse (in-order) the tree with a given operation, optionally accumulating
  * data in it_data. 'operation' must point to a valid function.
  * Usage of it_data is up to the operation function given by the user.
@@ -100,6 +272,21 @@ int bstree_traverse_preorder_cnt(const struct bstree *tree, void *it_data,
 int bstree_traverse_postorder_cnt(const struct bstree *tree, void *it_data,
         int (*operation)(void *object, void *it_data));
 
+/* Traverse the tree in the given order, delivering the objects in batches
+ * instead of one at a time. 'objects' and 'counts' are filled with up to
+ * 'cap' objects and their counts, and 'operation' is called with the
+ * number of objects in them each time they are full, and once more at the
+ * end with what is left. 'counts' may be NULL if they are of no interest.
+ * The traversal is done without recursion.
+ * Traversal is stopped when the operation returns true.
+ * Returns true if traversal is stopped by the operation function,
+ * else false (traversal is finished by visiting all nodes). Returns -1
+ * with errno set to EINVAL if 'cap' is less than 1.
+ */
+int bstree_traverse_chunks(const struct bstree *tree, enum bstree_order order,
+        void **objects, int *counts, int cap, void *it_data,
+        int (*operation)(void **objects, int *counts, int n, void *it_data));
+
 /* Return the count of the given key.
  */
 int bstree_count(const struct bstree *tree, const void *key);
@@ -108,6 +295,14 @@ int bstree_count(const struct bstree *tree, const void *key);
  */
 void *bstree_search(const struct bstree *tree, const void *key);
 
+/* Store the aggregate of the objects from lo to hi, both included, in out,
+ * for a tree made by bstree_new_augmented. Returns false if there are no
+ * objects in the range (or the tree is not augmented), out is left as it
+ * is then.
+ */
+int bstree_range_aggregate(const struct bstree *tree, const void *lo,
+        const void *hi, void *out);
+
 /* Finds and removes the node matching the given key and frees the object.
  * Does nothing if the given key is not found in the tree.
  */
@@ -118,7 +313,26 @@ void bstree_remove(struct bstree *tree, const void *key);
  */
 void bstree_release(struct bstree *tree, const void *key);
 
-/* Return the number of nodes in the tree.
+/* Return the least (greatest) object of the tree, NULL if it is empty.
+ * Takes O(1) time, except for trees made by bstree_new_fat.
+ */
+void *bstree_min(const struct bstree *tree);
+void *bstree_max(const struct bstree *tree);
+
+/* Take the least (greatest) object out of the tree, for using it as a
+ * priority queue, and return it, NULL if the tree is empty. Only one count
+ * of the object is taken: while the count is more than one, it is just
+ * decremented and the object stays in the tree. Otherwise the node is
+ * removed without calling the comparison function, and the object is not
+ * freed, as in bstree_release. Unless 'removed' is NULL, *removed is set
+ * to whether the object left the tree, i.e. whether the caller owns it
+ * now.
+ */
+void *bstree_pop_min(struct bstree *tree, int *removed);
+void *bstree_pop_max(struct bstree *tree, int *removed);
+
+/* Return the number of nodes (distinct objects) in the tree. Takes O(1)
+ * time, except for trees made by bstree_new_fat.
  */
 int bstree_size(struct bstree *tree);
 
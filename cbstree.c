@@ -0,0 +1,1154 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yağmur Oymak, Berk Özkütük
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cbstree.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* Bits of the version of a node. A node is marked as shrinking while it
+ * is being rotated down, i.e. while some keys that used to be under it
+ * are moved elsewhere. Readers that went through a node must make sure
+ * that its version did not change before they trust what they found below.
+ * Unlinked nodes are never linked again.
+ */
+#define UNLINKED 1UL
+#define SHRINKING 2UL
+
+/* Results of node_condition_, positive values are the height to be set */
+#define UNLINK_REQUIRED -1
+#define REBALANCE_REQUIRED -2
+#define NOTHING_REQUIRED -3
+
+/* Returned by the attempt_*_ functions when they have to start over */
+#define RETRY -1
+
+/* Number of retirements between attempts to advance the epoch */
+#define RETIRE_BATCH 64
+
+#define SPIN_COUNT 100
+
+/* Unlike in bstree.c, the height of a leaf is 1 and a missing node has
+ * height 0. A count of 0 means the node is a routing node, its object is
+ * kept only to guide the searches.
+ */
+struct cbstree_node {
+    void *_Atomic object;
+    _Atomic int count;
+    _Atomic int height;
+    _Atomic unsigned long version;
+    _Atomic int locked;
+    struct cbstree_node *_Atomic parent;
+    struct cbstree_node *_Atomic left;
+    struct cbstree_node *_Atomic right;
+};
+
+struct cbstree {
+    /* The right child of the holder is the root of the tree. The holder
+     * never changes its version, and it is never rotated.
+     */
+    struct cbstree_node holder;
+    int (*compare_object)(const void *lhs, const void *rhs);
+    void (*free_object)(void *object);
+};
+
+/* Something that was unlinked from a tree, waiting for the threads that
+ * may still be looking at it to move on. Either a node with its object,
+ * or an object alone.
+ */
+struct retired {
+    struct retired *next;
+    unsigned long epoch;
+    struct cbstree_node *node;
+    void *object;
+    void (*free_object)(void *object);
+};
+
+/* Every thread that has used a tree has one of these. The list of them
+ * only grows, a record is reused when its thread exits.
+ */
+struct ebr_thread {
+    _Atomic unsigned long epoch;
+    _Atomic int active;
+    _Atomic int in_use;
+    /* Oldest first */
+    struct retired *head;
+    struct retired *tail;
+    int nretired;
+    struct ebr_thread *next;
+};
+
+static _Atomic unsigned long ebr_epoch;
+static struct ebr_thread *_Atomic ebr_threads;
+static _Thread_local struct ebr_thread *ebr_self;
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+/* Epoch based reclamation. Threads enter a critical section before they
+ * touch a tree and leave it when they are done. Something retired in
+ * epoch e can be freed once the epoch is e + 2, as the epoch is only
+ * advanced when every thread in a critical section has seen the current
+ * one.
+ */
+
+static void ebr_thread_exit_(void *p)
+{
+    struct ebr_thread *self = p;
+    atomic_store(&self->active, 0);
+    atomic_store(&self->in_use, 0);
+}
+
+static void ebr_init_(void)
+{
+    pthread_key_create(&ebr_key, ebr_thread_exit_);
+}
+
+static struct ebr_thread *ebr_register_(void)
+{
+    struct ebr_thread *self;
+    int unused;
+    pthread_once(&ebr_once, ebr_init_);
+    for (self = atomic_load(&ebr_threads); self; self = self->next) {
+        unused = 0;
+        if (atomic_compare_exchange_strong(&self->in_use, &unused, 1)) {
+            break;
+        }
+    }
+    if (!self) {
+        self = malloc(sizeof *self);
+        atomic_init(&self->epoch, 0);
+        atomic_init(&self->active, 0);
+        atomic_init(&self->in_use, 1);
+        self->head = NULL;
+        self->tail = NULL;
+        self->nretired = 0;
+        self->next = atomic_load(&ebr_threads);
+        while (!atomic_compare_exchange_weak(&ebr_threads, &self->next,
+                    self)) {
+        }
+    }
+    pthread_setspecific(ebr_key, self);
+    ebr_self = self;
+    return self;
+}
+
+static void ebr_enter_(void)
+{
+    struct ebr_thread *self = ebr_self ? ebr_self : ebr_register_();
+    atomic_store(&self->active, 1);
+    atomic_store(&self->epoch, atomic_load(&ebr_epoch));
+}
+
+static void ebr_try_advance_(void)
+{
+    struct ebr_thread *t;
+    unsigned long epoch = atomic_load(&ebr_epoch);
+    for (t = atomic_load(&ebr_threads); t; t = t->next) {
+        if (atomic_load(&t->active) && atomic_load(&t->epoch) != epoch) {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&ebr_epoch, &epoch, epoch + 1);
+}
+
+/* Free whatever on the list is old enough.
+ */
+static void ebr_reclaim_(struct ebr_thread *self)
+{
+    unsigned long epoch = atomic_load(&ebr_epoch);
+    struct retired *r;
+    while (self->head && self->head->epoch + 2 <= epoch) {
+        r = self->head;
+        self->head = r->next;
+        self->nretired--;
+        if (r->free_object) {
+            r->free_object(r->object);
+        }
+        free(r->node);
+        free(r);
+    }
+    if (!self->head) {
+        self->tail = NULL;
+    }
+}
+
+static void ebr_exit_(void)
+{
+    struct ebr_thread *self = ebr_self;
+    atomic_store(&self->active, 0);
+    if (self->nretired >= RETIRE_BATCH) {
+        ebr_try_advance_();
+        ebr_reclaim_(self);
+    }
+}
+
+static void ebr_retire_(struct cbstree_node *node, void *object,
+        void (*free_object)(void *object))
+{
+    struct ebr_thread *self = ebr_self;
+    struct retired *r = malloc(sizeof *r);
+    r->next = NULL;
+    r->epoch = atomic_load(&ebr_epoch);
+    r->node = node;
+    r->object = object;
+    r->free_object = free_object;
+    if (self->tail) {
+        self->tail->next = r;
+    } else {
+        self->head = r;
+    }
+    self->tail = r;
+    self->nretired++;
+}
+
+/* Node helpers
+ */
+
+static void lock_(struct cbstree_node *node)
+{
+    int i, expected;
+    for (i = 0; ; i++) {
+        expected = 0;
+        if (!atomic_load(&node->locked) &&
+                atomic_compare_exchange_weak(&node->locked, &expected, 1)) {
+            return;
+        }
+        if (i >= SPIN_COUNT) {
+            sched_yield();
+        }
+    }
+}
+
+static void unlock_(struct cbstree_node *node)
+{
+    atomic_store(&node->locked, 0);
+}
+
+static unsigned long version_(struct cbstree_node *node)
+{
+    return atomic_load(&node->version);
+}
+
+static unsigned long begin_change_(unsigned long version)
+{
+    return version | SHRINKING;
+}
+
+/* Clear the shrinking bit and bump the change count */
+static unsigned long end_change_(unsigned long version)
+{
+    return (version | SHRINKING | UNLINKED) + 1;
+}
+
+static void wait_until_not_changing_(struct cbstree_node *node)
+{
+    unsigned long version = version_(node);
+    int i;
+    for (i = 0; (version & SHRINKING) && version_(node) == version; i++) {
+        if (i >= SPIN_COUNT) {
+            sched_yield();
+        }
+    }
+}
+
+static struct cbstree_node *child_(struct cbstree_node *node, int dir)
+{
+    return dir > 0 ? atomic_load(&node->right) : atomic_load(&node->left);
+}
+
+static void set_child_(struct cbstree_node *node, int dir,
+        struct cbstree_node *child)
+{
+    if (dir > 0) {
+        atomic_store(&node->right, child);
+    } else {
+        atomic_store(&node->left, child);
+    }
+}
+
+static int height_(struct cbstree_node *node)
+{
+    return node ? atomic_load(&node->height) : 0;
+}
+
+static int int_max_(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+static struct cbstree_node *mknode_(void *object, struct cbstree_node *parent)
+{
+    struct cbstree_node *node = malloc(sizeof *node);
+    atomic_init(&node->object, object);
+    atomic_init(&node->count, 1);
+    atomic_init(&node->height, 1);
+    atomic_init(&node->version, 0);
+    atomic_init(&node->locked, 0);
+    atomic_init(&node->parent, parent);
+    atomic_init(&node->left, NULL);
+    atomic_init(&node->right, NULL);
+    return node;
+}
+
+static int can_unlink_(struct cbstree_node *node)
+{
+    return !atomic_load(&node->left) || !atomic_load(&node->right);
+}
+
+/* Rebalancing. Functions with the _nl suffix expect the caller to hold
+ * the locks of the nodes they change. Each of them returns the node that
+ * should be looked at next, NULL if there is nothing left to do.
+ *
+ * A rotation that leaves the node it moved down out of balance returns
+ * that node, and the height of the parent of the rotation may still be
+ * wrong after that node is fixed, without anything changing in between.
+ * Such parents are kept aside, to be looked at once the walk below them
+ * is done.
+ */
+
+#define DAMAGE_MAX 64
+
+struct damage {
+    struct cbstree_node *nodes[DAMAGE_MAX];
+    int n;
+};
+
+static struct cbstree_node *defer_(struct damage *damage,
+        struct cbstree_node *parent, struct cbstree_node *next)
+{
+    /* Past the limit, the parent stays a bit off until the next update
+     * around it. The tree is never that high.
+     */
+    if (damage->n < DAMAGE_MAX) {
+        damage->nodes[damage->n++] = parent;
+    }
+    return next;
+}
+
+static int node_condition_(struct cbstree_node *node)
+{
+    struct cbstree_node *left = atomic_load(&node->left);
+    struct cbstree_node *right = atomic_load(&node->right);
+    int h, hl, hr, h_repl, bal;
+    if ((!left || !right) && atomic_load(&node->count) == 0) {
+        return UNLINK_REQUIRED;
+    }
+    h = atomic_load(&node->height);
+    hl = height_(left);
+    hr = height_(right);
+    h_repl = 1 + int_max_(hl, hr);
+    bal = hl - hr;
+    if (bal < -1 || bal > 1) {
+        return REBALANCE_REQUIRED;
+    }
+    return h != h_repl ? h_repl : NOTHING_REQUIRED;
+}
+
+static struct cbstree_node *fix_height_nl_(struct cbstree_node *node)
+{
+    int condition = node_condition_(node);
+    switch (condition) {
+    case REBALANCE_REQUIRED:
+    case UNLINK_REQUIRED:
+        /* Needs the lock of the parent */
+        return node;
+    case NOTHING_REQUIRED:
+        return NULL;
+    default:
+        atomic_store(&node->height, condition);
+        return atomic_load(&node->parent);
+    }
+}
+
+/* Unlink a routing node that has at most one child.
+ */
+static int attempt_unlink_nl_(struct cbstree_node *parent,
+        struct cbstree_node *node)
+{
+    struct cbstree_node *parent_left = atomic_load(&parent->left);
+    struct cbstree_node *parent_right = atomic_load(&parent->right);
+    struct cbstree_node *left, *right, *splice;
+    if (parent_left != node && parent_right != node) {
+        return 0;
+    }
+    left = atomic_load(&node->left);
+    right = atomic_load(&node->right);
+    if (left && right) {
+        return 0;
+    }
+    splice = left ? left : right;
+    if (parent_left == node) {
+        atomic_store(&parent->left, splice);
+    } else {
+        atomic_store(&parent->right, splice);
+    }
+    if (splice) {
+        atomic_store(&splice->parent, parent);
+    }
+    atomic_store(&node->version, UNLINKED);
+    return 1;
+}
+
+static struct cbstree_node *rotate_right_nl_(struct damage *damage,
+        struct cbstree_node *parent, struct cbstree_node *n,
+        struct cbstree_node *nl, int hr, int hll, struct cbstree_node *nlr,
+        int hlr)
+{
+    unsigned long version = version_(n);
+    int h_repl, bal_n, bal_l;
+    struct cbstree_node *parent_left = atomic_load(&parent->left);
+    atomic_store(&n->version, begin_change_(version));
+    atomic_store(&n->left, nlr);
+    if (nlr) {
+        atomic_store(&nlr->parent, n);
+    }
+    atomic_store(&nl->right, n);
+    atomic_store(&n->parent, nl);
+    if (parent_left == n) {
+        atomic_store(&parent->left, nl);
+    } else {
+        atomic_store(&parent->right, nl);
+    }
+    atomic_store(&nl->parent, parent);
+    h_repl = 1 + int_max_(hlr, hr);
+    atomic_store(&n->height, h_repl);
+    atomic_store(&nl->height, 1 + int_max_(hll, h_repl));
+    atomic_store(&n->version, end_change_(version));
+    bal_n = hlr - hr;
+    if (bal_n < -1 || bal_n > 1) {
+        return defer_(damage, parent, n);
+    }
+    if ((!nlr || hr == 0) && atomic_load(&n->count) == 0) {
+        return defer_(damage, parent, n);
+    }
+    bal_l = hll - h_repl;
+    if (bal_l < -1 || bal_l > 1) {
+        return nl;
+    }
+    if (hll == 0 && atomic_load(&nl->count) == 0) {
+        return nl;
+    }
+    return fix_height_nl_(parent);
+}
+
+static struct cbstree_node *rotate_left_nl_(struct damage *damage,
+        struct cbstree_node *parent, struct cbstree_node *n, int hl,
+        struct cbstree_node *nr, struct cbstree_node *nrl, int hrl, int hrr)
+{
+    unsigned long version = version_(n);
+    int h_repl, bal_n, bal_r;
+    struct cbstree_node *parent_left = atomic_load(&parent->left);
+    atomic_store(&n->version, begin_change_(version));
+    atomic_store(&n->right, nrl);
+    if (nrl) {
+        atomic_store(&nrl->parent, n);
+    }
+    atomic_store(&nr->left, n);
+    atomic_store(&n->parent, nr);
+    if (parent_left == n) {
+        atomic_store(&parent->left, nr);
+    } else {
+        atomic_store(&parent->right, nr);
+    }
+    atomic_store(&nr->parent, parent);
+    h_repl = 1 + int_max_(hl, hrl);
+    atomic_store(&n->height, h_repl);
+    atomic_store(&nr->height, 1 + int_max_(h_repl, hrr));
+    atomic_store(&n->version, end_change_(version));
+    bal_n = hrl - hl;
+    if (bal_n < -1 || bal_n > 1) {
+        return defer_(damage, parent, n);
+    }
+    if ((!nrl || hl == 0) && atomic_load(&n->count) == 0) {
+        return defer_(damage, parent, n);
+    }
+    bal_r = hrr - h_repl;
+    if (bal_r < -1 || bal_r > 1) {
+        return nr;
+    }
+    if (hrr == 0 && atomic_load(&nr->count) == 0) {
+        return nr;
+    }
+    return fix_height_nl_(parent);
+}
+
+static struct cbstree_node *rotate_right_over_left_nl_(
+        struct damage *damage, struct cbstree_node *parent,
+        struct cbstree_node *n, struct cbstree_node *nl, int hr, int hll,
+        struct cbstree_node *nlr, int hlrl)
+{
+    unsigned long version = version_(n);
+    unsigned long left_version = version_(nl);
+    struct cbstree_node *parent_left = atomic_load(&parent->left);
+    struct cbstree_node *nlrl = atomic_load(&nlr->left);
+    struct cbstree_node *nlrr = atomic_load(&nlr->right);
+    int hlrr = height_(nlrr);
+    int h_repl, hl_repl, bal_n, bal_lr;
+    atomic_store(&n->version, begin_change_(version));
+    atomic_store(&nl->version, begin_change_(left_version));
+    atomic_store(&n->left, nlrr);
+    if (nlrr) {
+        atomic_store(&nlrr->parent, n);
+    }
+    atomic_store(&nl->right, nlrl);
+    if (nlrl) {
+        atomic_store(&nlrl->parent, nl);
+    }
+    atomic_store(&nlr->left, nl);
+    atomic_store(&nl->parent, nlr);
+    atomic_store(&nlr->right, n);
+    atomic_store(&n->parent, nlr);
+    if (parent_left == n) {
+        atomic_store(&parent->left, nlr);
+    } else {
+        atomic_store(&parent->right, nlr);
+    }
+    atomic_store(&nlr->parent, parent);
+    h_repl = 1 + int_max_(hlrr, hr);
+    atomic_store(&n->height, h_repl);
+    hl_repl = 1 + int_max_(hll, hlrl);
+    atomic_store(&nl->height, hl_repl);
+    atomic_store(&nlr->height, 1 + int_max_(hl_repl, h_repl));
+    atomic_store(&n->version, end_change_(version));
+    atomic_store(&nl->version, end_change_(left_version));
+    bal_n = hlrr - hr;
+    if (bal_n < -1 || bal_n > 1) {
+        return defer_(damage, parent, n);
+    }
+    if ((!nlrr || hr == 0) && atomic_load(&n->count) == 0) {
+        return defer_(damage, parent, n);
+    }
+    bal_lr = hl_repl - h_repl;
+    if (bal_lr < -1 || bal_lr > 1) {
+        return nlr;
+    }
+    /* nl may be a routing node left with a single child */
+    if ((hll == 0 || hlrl == 0) && atomic_load(&nl->count) == 0) {
+        return defer_(damage, parent, nl);
+    }
+    return fix_height_nl_(parent);
+}
+
+static struct cbstree_node *rotate_left_over_right_nl_(
+        struct damage *damage, struct cbstree_node *parent,
+        struct cbstree_node *n, int hl, struct cbstree_node *nr,
+        struct cbstree_node *nrl, int hrr, int hrlr)
+{
+    unsigned long version = version_(n);
+    unsigned long right_version = version_(nr);
+    struct cbstree_node *parent_left = atomic_load(&parent->left);
+    struct cbstree_node *nrll = atomic_load(&nrl->left);
+    struct cbstree_node *nrlr = atomic_load(&nrl->right);
+    int hrll = height_(nrll);
+    int h_repl, hr_repl, bal_n, bal_rl;
+    atomic_store(&n->version, begin_change_(version));
+    atomic_store(&nr->version, begin_change_(right_version));
+    atomic_store(&n->right, nrll);
+    if (nrll) {
+        atomic_store(&nrll->parent, n);
+    }
+    atomic_store(&nr->left, nrlr);
+    if (nrlr) {
+        atomic_store(&nrlr->parent, nr);
+    }
+    atomic_store(&nrl->right, nr);
+    atomic_store(&nr->parent, nrl);
+    atomic_store(&nrl->left, n);
+    atomic_store(&n->parent, nrl);
+    if (parent_left == n) {
+        atomic_store(&parent->left, nrl);
+    } else {
+        atomic_store(&parent->right, nrl);
+    }
+    atomic_store(&nrl->parent, parent);
+    h_repl = 1 + int_max_(hl, hrll);
+    atomic_store(&n->height, h_repl);
+    hr_repl = 1 + int_max_(hrlr, hrr);
+    atomic_store(&nr->height, hr_repl);
+    atomic_store(&nrl->height, 1 + int_max_(h_repl, hr_repl));
+    atomic_store(&n->version, end_change_(version));
+    atomic_store(&nr->version, end_change_(right_version));
+    bal_n = hrll - hl;
+    if (bal_n < -1 || bal_n > 1) {
+        return defer_(damage, parent, n);
+    }
+    if ((!nrll || hl == 0) && atomic_load(&n->count) == 0) {
+        return defer_(damage, parent, n);
+    }
+    bal_rl = hr_repl - h_repl;
+    if (bal_rl < -1 || bal_rl > 1) {
+        return nrl;
+    }
+    if ((hrr == 0 || hrlr == 0) && atomic_load(&nr->count) == 0) {
+        return defer_(damage, parent, nr);
+    }
+    return fix_height_nl_(parent);
+}
+
+static struct cbstree_node *rebalance_to_left_nl_(struct damage *damage,
+        struct cbstree_node *parent, struct cbstree_node *n,
+        struct cbstree_node *nr, int hl0);
+
+static struct cbstree_node *rebalance_to_right_nl_(struct damage *damage,
+        struct cbstree_node *parent, struct cbstree_node *n,
+        struct cbstree_node *nl, int hr0)
+{
+    struct cbstree_node *nlr, *next;
+    int hll0, hlr0, hlr, hlrl, b;
+    lock_(nl);
+    if (atomic_load(&nl->height) - hr0 <= 1) {
+        /* Changed under us, retry */
+        unlock_(nl);
+        return n;
+    }
+    nlr = atomic_load(&nl->right);
+    hll0 = height_(atomic_load(&nl->left));
+    hlr0 = height_(nlr);
+    if (hll0 >= hlr0) {
+        next = rotate_right_nl_(damage, parent, n, nl, hr0, hll0, nlr, hlr0);
+        unlock_(nl);
+        return next;
+    }
+    lock_(nlr);
+    hlr = atomic_load(&nlr->height);
+    if (hll0 >= hlr) {
+        next = rotate_right_nl_(damage, parent, n, nl, hr0, hll0, nlr, hlr);
+        unlock_(nlr);
+        unlock_(nl);
+        return next;
+    }
+    hlrl = height_(atomic_load(&nlr->left));
+    b = hll0 - hlrl;
+    if (b >= -1 && b <= 1) {
+        next = rotate_right_over_left_nl_(damage, parent, n, nl, hr0, hll0, nlr,
+                hlrl);
+        unlock_(nlr);
+        unlock_(nl);
+        return next;
+    }
+    unlock_(nlr);
+    /* The double rotation would leave nl out of balance, so we first
+     * rotate at nl and leave n for the next round.
+     */
+    next = rebalance_to_left_nl_(damage, n, nl, nlr, hll0);
+    unlock_(nl);
+    return next;
+}
+
+static struct cbstree_node *rebalance_to_left_nl_(struct damage *damage,
+        struct cbstree_node *parent, struct cbstree_node *n,
+        struct cbstree_node *nr, int hl0)
+{
+    struct cbstree_node *nrl, *next;
+    int hrl0, hrr0, hrl, hrlr, b;
+    lock_(nr);
+    if (hl0 - atomic_load(&nr->height) >= -1) {
+        /* Changed under us, retry */
+        unlock_(nr);
+        return n;
+    }
+    nrl = atomic_load(&nr->left);
+    hrl0 = height_(nrl);
+    hrr0 = height_(atomic_load(&nr->right));
+    if (hrr0 >= hrl0) {
+        next = rotate_left_nl_(damage, parent, n, hl0, nr, nrl, hrl0, hrr0);
+        unlock_(nr);
+        return next;
+    }
+    lock_(nrl);
+    hrl = atomic_load(&nrl->height);
+    if (hrr0 >= hrl) {
+        next = rotate_left_nl_(damage, parent, n, hl0, nr, nrl, hrl, hrr0);
+        unlock_(nrl);
+        unlock_(nr);
+        return next;
+    }
+    hrlr = height_(atomic_load(&nrl->right));
+    b = hrr0 - hrlr;
+    if (b >= -1 && b <= 1) {
+        next = rotate_left_over_right_nl_(damage, parent, n, hl0, nr, nrl, hrr0,
+                hrlr);
+        unlock_(nrl);
+        unlock_(nr);
+        return next;
+    }
+    unlock_(nrl);
+    next = rebalance_to_right_nl_(damage, n, nr, nrl, hrr0);
+    unlock_(nr);
+    return next;
+}
+
+static struct cbstree_node *rebalance_nl_(struct cbstree *tree,
+        struct damage *damage, struct cbstree_node *parent,
+        struct cbstree_node *n)
+{
+    struct cbstree_node *nl = atomic_load(&n->left);
+    struct cbstree_node *nr = atomic_load(&n->right);
+    int h, hl0, hr0, h_repl, bal;
+    if ((!nl || !nr) && atomic_load(&n->count) == 0) {
+        if (attempt_unlink_nl_(parent, n)) {
+            ebr_retire_(n, atomic_load(&n->object), tree->free_object);
+            return fix_height_nl_(parent);
+        }
+        return n;
+    }
+    h = atomic_load(&n->height);
+    hl0 = height_(nl);
+    hr0 = height_(nr);
+    h_repl = 1 + int_max_(hl0, hr0);
+    bal = hl0 - hr0;
+    if (bal > 1) {
+        return rebalance_to_right_nl_(damage, parent, n, nl, hr0);
+    }
+    if (bal < -1) {
+        return rebalance_to_left_nl_(damage, parent, n, nr, hl0);
+    }
+    if (h_repl != h) {
+        atomic_store(&n->height, h_repl);
+        return fix_height_nl_(parent);
+    }
+    return NULL;
+}
+
+/* Walk up from the node, fixing heights, unlinking routing nodes and
+ * rotating as needed.
+ *
+ * The walk only stops at a node that needs nothing once that is seen
+ * under its lock. Another thread may hold it, fixing its height from the
+ * height this thread's last change replaced, and the node would be left
+ * with that if this thread stopped before it was stored.
+ */
+static void fix_height_and_rebalance_(struct cbstree *tree,
+        struct cbstree_node *node)
+{
+    struct cbstree_node *locked, *parent;
+    struct damage damage;
+    int condition;
+    damage.n = 0;
+    for (;;) {
+        if (damage.n > 0 && node == damage.nodes[damage.n - 1]) {
+            damage.n--;
+        }
+        if (!node || !atomic_load(&node->parent) ||
+                (version_(node) & UNLINKED)) {
+            if (damage.n == 0) {
+                return;
+            }
+            node = damage.nodes[--damage.n];
+        } else if ((condition = node_condition_(node)) != UNLINK_REQUIRED &&
+                condition != REBALANCE_REQUIRED) {
+            locked = node;
+            lock_(locked);
+            node = fix_height_nl_(locked);
+            unlock_(locked);
+        } else {
+            parent = atomic_load(&node->parent);
+            lock_(parent);
+            if (!(version_(parent) & UNLINKED) &&
+                    atomic_load(&node->parent) == parent) {
+                locked = node;
+                lock_(locked);
+                node = rebalance_nl_(tree, &damage, parent, locked);
+                unlock_(locked);
+            }
+            unlock_(parent);
+        }
+    }
+}
+
+/* Searching and updating. Each attempt_*_ function continues from 'node',
+ * which was reached while its version was 'version', towards the child in
+ * direction 'dir'. Seeing a different version means the node has been
+ * rotated down meanwhile, and the key might not be under it anymore.
+ */
+
+static struct cbstree_node retry_node_;
+
+static struct cbstree_node *attempt_get_(struct cbstree *tree,
+        const void *key, struct cbstree_node *node, int dir,
+        unsigned long version)
+{
+    struct cbstree_node *child, *found;
+    unsigned long child_version;
+    int next_dir;
+    for (;;) {
+        child = child_(node, dir);
+        if (version_(node) != version) {
+            return &retry_node_;
+        }
+        if (!child) {
+            return NULL;
+        }
+        next_dir = tree->compare_object(key, atomic_load(&child->object));
+        if (next_dir == 0) {
+            return child;
+        }
+        child_version = version_(child);
+        if (child_version & SHRINKING) {
+            wait_until_not_changing_(child);
+        } else if (!(child_version & UNLINKED) &&
+                child == child_(node, dir)) {
+            if (version_(node) != version) {
+                return &retry_node_;
+            }
+            found = attempt_get_(tree, key, child, next_dir, child_version);
+            if (found != &retry_node_) {
+                return found;
+            }
+        }
+    }
+}
+
+/* Return the node holding the key, which may be a routing node.
+ */
+static struct cbstree_node *get_(struct cbstree *tree, const void *key)
+{
+    struct cbstree_node *found;
+    do {
+        found = attempt_get_(tree, key, &tree->holder, 1, 0);
+    } while (found == &retry_node_);
+    return found;
+}
+
+static int attempt_insert_(struct cbstree *tree, void *object,
+        struct cbstree_node *node, int dir, unsigned long version)
+{
+    lock_(node);
+    if (version_(node) != version || child_(node, dir)) {
+        unlock_(node);
+        return RETRY;
+    }
+    set_child_(node, dir, mknode_(object, node));
+    unlock_(node);
+    fix_height_and_rebalance_(tree, node);
+    return 1;
+}
+
+static int attempt_update_(struct cbstree *tree, struct cbstree_node *node,
+        void *object)
+{
+    void *old;
+    int count;
+    lock_(node);
+    if (version_(node) & UNLINKED) {
+        unlock_(node);
+        return RETRY;
+    }
+    count = atomic_load(&node->count);
+    if (count == 0) {
+        /* A routing node gets the key back, with the new object. Searches
+         * may still be comparing against the old one.
+         */
+        old = atomic_load(&node->object);
+        atomic_store(&node->object, object);
+        atomic_store(&node->count, 1);
+        unlock_(node);
+        ebr_retire_(NULL, old, tree->free_object);
+        return 1;
+    }
+    atomic_store(&node->count, count + 1);
+    unlock_(node);
+    /* Nobody else has seen this one */
+    if (tree->free_object) {
+        tree->free_object(object);
+    }
+    return count + 1;
+}
+
+static int attempt_put_(struct cbstree *tree, void *object,
+        struct cbstree_node *node, int dir, unsigned long version)
+{
+    struct cbstree_node *child;
+    unsigned long child_version;
+    int next_dir, result = RETRY;
+    do {
+        child = child_(node, dir);
+        if (version_(node) != version) {
+            return RETRY;
+        }
+        if (!child) {
+            result = attempt_insert_(tree, object, node, dir, version);
+            continue;
+        }
+        next_dir = tree->compare_object(object, atomic_load(&child->object));
+        if (next_dir == 0) {
+            result = attempt_update_(tree, child, object);
+            continue;
+        }
+        child_version = version_(child);
+        if (child_version & SHRINKING) {
+            wait_until_not_changing_(child);
+        } else if (!(child_version & UNLINKED) &&
+                child == child_(node, dir)) {
+            if (version_(node) != version) {
+                return RETRY;
+            }
+            result = attempt_put_(tree, object, child, next_dir,
+                    child_version);
+        }
+    } while (result == RETRY);
+    return result;
+}
+
+static int attempt_remove_node_(struct cbstree *tree,
+        struct cbstree_node *parent, struct cbstree_node *node)
+{
+    struct cbstree_node *splice;
+    int count;
+    if (atomic_load(&node->count) == 0) {
+        return 0;
+    }
+    if (!can_unlink_(node)) {
+        /* Two children, the node stays as a routing node */
+        lock_(node);
+        if ((version_(node) & UNLINKED) || can_unlink_(node)) {
+            unlock_(node);
+            return RETRY;
+        }
+        count = atomic_load(&node->count);
+        atomic_store(&node->count, 0);
+        unlock_(node);
+        return count;
+    }
+    lock_(parent);
+    if ((version_(parent) & UNLINKED) ||
+            atomic_load(&node->parent) != parent ||
+            (version_(node) & UNLINKED)) {
+        unlock_(parent);
+        return RETRY;
+    }
+    lock_(node);
+    count = atomic_load(&node->count);
+    if (count == 0 || !can_unlink_(node)) {
+        unlock_(node);
+        unlock_(parent);
+        return count == 0 ? 0 : RETRY;
+    }
+    splice = atomic_load(&node->left);
+    if (!splice) {
+        splice = atomic_load(&node->right);
+    }
+    if (atomic_load(&parent->left) == node) {
+        atomic_store(&parent->left, splice);
+    } else {
+        atomic_store(&parent->right, splice);
+    }
+    if (splice) {
+        atomic_store(&splice->parent, parent);
+    }
+    atomic_store(&node->version, UNLINKED);
+    atomic_store(&node->count, 0);
+    unlock_(node);
+    unlock_(parent);
+    ebr_retire_(node, atomic_load(&node->object), tree->free_object);
+    fix_height_and_rebalance_(tree, parent);
+    return count;
+}
+
+static int attempt_remove_(struct cbstree *tree, const void *key,
+        struct cbstree_node *node, int dir, unsigned long version)
+{
+    struct cbstree_node *child;
+    unsigned long child_version;
+    int next_dir, result = RETRY;
+    do {
+        child = child_(node, dir);
+        if (version_(node) != version) {
+            return RETRY;
+        }
+        if (!child) {
+            return 0;
+        }
+        next_dir = tree->compare_object(key, atomic_load(&child->object));
+        if (next_dir == 0) {
+            result = attempt_remove_node_(tree, node, child);
+            continue;
+        }
+        child_version = version_(child);
+        if (child_version & SHRINKING) {
+            wait_until_not_changing_(child);
+        } else if (!(child_version & UNLINKED) &&
+                child == child_(node, dir)) {
+            if (version_(node) != version) {
+                return RETRY;
+            }
+            result = attempt_remove_(tree, key, child, next_dir,
+                    child_version);
+        }
+    } while (result == RETRY);
+    return result;
+}
+
+static void destroy_(struct cbstree_node *node,
+        void (*free_object)(void *object))
+{
+    if (!node) {
+        return;
+    }
+    destroy_(atomic_load(&node->left), free_object);
+    destroy_(atomic_load(&node->right), free_object);
+    if (free_object) {
+        free_object(atomic_load(&node->object));
+    }
+    free(node);
+}
+
+static int size_(struct cbstree_node *node)
+{
+    if (!node) {
+        return 0;
+    }
+    return size_(atomic_load(&node->left)) +
+        size_(atomic_load(&node->right)) +
+        (atomic_load(&node->count) > 0);
+}
+
+/* Return the height of the subtree, or -1 if it is not what a tree nobody
+ * is changing should look like: keys in order, right parents and heights,
+ * balanced, and without routing nodes that could be unlinked. '*last' is
+ * the greatest object seen so far, in order.
+ */
+static int valid_(struct cbstree *tree, struct cbstree_node *node,
+        struct cbstree_node *parent, void **last)
+{
+    int hl, hr;
+    if (!node) {
+        return 0;
+    }
+    if (atomic_load(&node->parent) != parent) {
+        return -1;
+    }
+    hl = valid_(tree, atomic_load(&node->left), node, last);
+    if (hl < 0 || (*last && tree->compare_object(*last,
+                    atomic_load(&node->object)) >= 0)) {
+        return -1;
+    }
+    *last = atomic_load(&node->object);
+    hr = valid_(tree, atomic_load(&node->right), node, last);
+    if (hr < 0 || hl - hr < -1 || hl - hr > 1 ||
+            atomic_load(&node->height) != 1 + int_max_(hl, hr) ||
+            (atomic_load(&node->count) == 0 && can_unlink_(node))) {
+        return -1;
+    }
+    return 1 + int_max_(hl, hr);
+}
+
+/* Interface functions
+ */
+
+struct cbstree *cbstree_new(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct cbstree *tree = malloc(sizeof *tree);
+    atomic_init(&tree->holder.object, NULL);
+    atomic_init(&tree->holder.count, 0);
+    atomic_init(&tree->holder.height, 0);
+    atomic_init(&tree->holder.version, 0);
+    atomic_init(&tree->holder.locked, 0);
+    atomic_init(&tree->holder.parent, NULL);
+    atomic_init(&tree->holder.left, NULL);
+    atomic_init(&tree->holder.right, NULL);
+    tree->compare_object = compare_object;
+    tree->free_object = free_object;
+    return tree;
+}
+
+void cbstree_destroy(struct cbstree *tree)
+{
+    struct ebr_thread *t;
+    int unused;
+    destroy_(atomic_load(&tree->holder.right), tree->free_object);
+    free(tree);
+    /* Be done with what this thread has removed, and with what the threads
+     * that have exited left behind.
+     */
+    for (t = atomic_load(&ebr_threads); t; t = t->next) {
+        unused = 0;
+        if (t != ebr_self &&
+                !atomic_compare_exchange_strong(&t->in_use, &unused, 1)) {
+            continue;
+        }
+        while (t->head) {
+            ebr_try_advance_();
+            ebr_reclaim_(t);
+            if (t->head) {
+                sched_yield();
+            }
+        }
+        if (t != ebr_self) {
+            atomic_store(&t->in_use, 0);
+        }
+    }
+}
+
+int cbstree_insert(struct cbstree *tree, void *object)
+{
+    int count;
+    ebr_enter_();
+    count = attempt_put_(tree, object, &tree->holder, 1, 0);
+    ebr_exit_();
+    return count;
+}
+
+int cbstree_count(struct cbstree *tree, const void *key)
+{
+    struct cbstree_node *node;
+    int count;
+    ebr_enter_();
+    node = get_(tree, key);
+    count = node ? atomic_load(&node->count) : 0;
+    ebr_exit_();
+    return count;
+}
+
+void *cbstree_search(struct cbstree *tree, const void *key)
+{
+    struct cbstree_node *node;
+    void *object = NULL;
+    ebr_enter_();
+    node = get_(tree, key);
+    if (node && atomic_load(&node->count) > 0) {
+        object = atomic_load(&node->object);
+    }
+    ebr_exit_();
+    return object;
+}
+
+int cbstree_remove(struct cbstree *tree, const void *key)
+{
+    int count;
+    ebr_enter_();
+    count = attempt_remove_(tree, key, &tree->holder, 1, 0);
+    ebr_exit_();
+    return count;
+}
+
+int cbstree_size(struct cbstree *tree)
+{
+    return size_(atomic_load(&tree->holder.right));
+}
+
+int cbstree_valid(struct cbstree *tree)
+{
+    void *last = NULL;
+    return valid_(tree, atomic_load(&tree->holder.right), &tree->holder,
+            &last) >= 0;
+}
@@ -0,0 +1,87 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yağmur Oymak, Berk Özkütük
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CBSTREE_H
+#define CBSTREE_H
+
+/* A concurrent variant of the tree, following "A Practical Concurrent
+ * Binary Search Tree" by Bronson, Casper, Chafi and Olukotun.
+ * Any number of threads may use the same tree at once, every function
+ * below is linearizable, except for cbstree_new, cbstree_destroy,
+ * cbstree_size and cbstree_valid.
+ *
+ ** Lookups take no locks, they validate what they read against version
+ * numbers kept in the nodes, and retry if a rotation got in their way.
+ ** Updates lock only the nodes they change, and balance is restored
+ * lazily, so the tree may be briefly out of balance under contention.
+ ** A key removed from a node with two children leaves the node in the
+ * tree as a routing node, until it gets unlinked by a later rebalancing.
+ ** Nodes and objects are freed only once no thread can be looking at them
+ * anymore (epoch based reclamation), so free_object may be called late,
+ * and from any thread using a tree.
+ *
+ * Counts work as in bstree.h. The objects are owned by the tree if
+ * free_object is given, otherwise they must outlive the tree.
+ */
+
+struct cbstree;
+
+struct cbstree *cbstree_new(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object));
+
+/* Destroy the tree. No other thread may be using it. What this thread and
+ * the threads that have exited removed earlier is freed as well, nodes
+ * removed by the other threads are freed by those threads later on.
+ */
+void cbstree_destroy(struct cbstree *tree);
+
+/* Inserts the given object to the tree. If the object already exists,
+ * increment the count. Returns the count of the object after insertion.
+ */
+int cbstree_insert(struct cbstree *tree, void *object);
+
+/* Return the count of the given key.
+ */
+int cbstree_count(struct cbstree *tree, const void *key);
+
+/* Return the pointer to the object matching the given key. If another
+ * thread may remove the key, the object may be freed at any time after
+ * this returns, so this is mostly useful when free_object is NULL.
+ */
+void *cbstree_search(struct cbstree *tree, const void *key);
+
+/* Finds and removes the key, the object is freed later on if free_object
+ * is given. Returns the count the key had, 0 if it was not in the tree.
+ */
+int cbstree_remove(struct cbstree *tree, const void *key);
+
+/* Return the number of keys in the tree. This is only exact when no other
+ * thread is changing the tree.
+ */
+int cbstree_size(struct cbstree *tree);
+
+/* Return whether the tree is in order and balanced, as it must be once no
+ * thread is changing it anymore: every key greater than the ones before
+ * it, every height right and within one of its sibling's, and no routing
+ * node left that could have been unlinked. No other thread may be using
+ * the tree. Meant for tests, takes O(n) time.
+ */
+int cbstree_valid(struct cbstree *tree);
+
+#endif
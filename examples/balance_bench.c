@@ -0,0 +1,151 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yağmur Oymak, Berk Özkütük
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compare the AVL and the weak AVL balancing policies on streams of mixed
+ * insertions and deletions. Usage: ./main.out [n_keys] [n_ops]
+ */
+
+#include "bstree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define N_KEYS 1000000
+#define N_OPS 4000000
+
+struct policy {
+    const char *name;
+    struct bstree *(*new)(
+            int (*compare_object)(const void *lhs, const void *rhs),
+            void (*free_object)(void *object));
+};
+
+struct workload {
+    const char *name;
+    /* Fill in the i'th operation, the key to use and whether to delete it */
+    void (*next)(long i, long n_keys, long *key, int *delete);
+    /* Whether the tree starts with the lower half of the keys, instead of
+     * random ones.
+     */
+    int sequential;
+};
+
+static int cmp_long(const void *lhs, const void *rhs)
+{
+    long l = *(const long *)lhs;
+    long r = *(const long *)rhs;
+    return (l > r) - (l < r);
+}
+
+static long rnd(long n)
+{
+    return (((long)rand() << 16) ^ rand()) % n;
+}
+
+/* Random keys, half of the operations are deletions */
+static void mixed(long i, long n_keys, long *key, int *delete)
+{
+    (void)i;
+    *key = rnd(n_keys);
+    *delete = rand() % 2;
+}
+
+/* Random keys, three deletions for each insertion */
+static void delete_heavy(long i, long n_keys, long *key, int *delete)
+{
+    (void)i;
+    *key = rnd(n_keys);
+    *delete = rand() % 4 != 0;
+}
+
+/* Increasing keys in a sliding window, the oldest key is deleted after
+ * each insertion, like a queue ordered by time.
+ */
+static void sliding_window(long i, long n_keys, long *key, int *delete)
+{
+    *delete = i % 2;
+    *key = *delete ? i / 2 : i / 2 + n_keys / 2;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(const struct policy *policy, const struct workload *workload,
+        long *keys, long n_keys, long n_ops)
+{
+    struct bstree *tree = policy->new(cmp_long, NULL);
+    long i, key;
+    int delete;
+    double elapsed;
+    srand(1);
+    /* Start half full */
+    for (i = 0; i < n_keys / 2; i++) {
+        bstree_insert(tree, &keys[workload->sequential ? i : rnd(n_keys)]);
+    }
+    elapsed = now();
+    for (i = 0; i < n_ops; i++) {
+        workload->next(i, n_keys, &key, &delete);
+        if (delete) {
+            bstree_remove(tree, &keys[key % n_keys]);
+        } else {
+            bstree_insert(tree, &keys[key % n_keys]);
+        }
+    }
+    elapsed = now() - elapsed;
+    printf("%-16s %-6s %8.3f s %10.1f ns/op  size %8d  height %3d\n",
+            workload->name, policy->name, elapsed, elapsed * 1e9 / n_ops,
+            bstree_size(tree), bstree_height(tree));
+    bstree_destroy(tree);
+}
+
+int main(int argc, char **argv)
+{
+    const struct policy policies[] = {
+        { "avl", bstree_new },
+        { "wavl", bstree_new_wavl }
+    };
+    const struct workload workloads[] = {
+        { "mixed", mixed, 0 },
+        { "delete-heavy", delete_heavy, 0 },
+        { "sliding-window", sliding_window, 1 }
+    };
+    long n_keys = argc > 1 ? atol(argv[1]) : N_KEYS;
+    long n_ops = argc > 2 ? atol(argv[2]) : N_OPS;
+    long *keys;
+    size_t i, j;
+    if (n_keys < 2 || n_ops < 1) {
+        fprintf(stderr, "Usage: %s [n_keys] [n_ops]\n", argv[0]);
+        return 1;
+    }
+    keys = malloc(n_keys * sizeof *keys);
+    for (i = 0; i < (size_t)n_keys; i++) {
+        keys[i] = i;
+    }
+    for (i = 0; i < sizeof workloads / sizeof *workloads; i++) {
+        for (j = 0; j < sizeof policies / sizeof *policies; j++) {
+            run(&policies[j], &workloads[i], keys, n_keys, n_ops);
+        }
+    }
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,330 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yağmur Oymak, Berk Özkütük
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Hammer a concurrent tree from several threads and check the results.
+ * Usage: ./main.out [n_threads] [n_rounds]
+ *
+ ** Each thread owns a part of the keys and checks every result, and what
+ * a search finds, against a sequential model, while all threads keep
+ * reading all the keys.
+ ** All threads insert the same keys, the counts must add up at the end.
+ ** Whenever the threads stop, the tree is walked to check that it is in
+ * order and balanced.
+ ** In many short rounds, the threads race on a few keys, and the history
+ * of each key is checked to be linearizable by trying every order of the
+ * operations that respects their real time order.
+ *
+ * Tested with 1, 2, 3, 4, 5, 8 and 16 threads, built with gcc 12 at -O2,
+ * plain and with -fsanitize=thread, on Linux 6.18 with a single CPU (Intel
+ * Xeon), where the threads interleave when they are preempted.
+ */
+
+#include "cbstree.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_THREADS 16
+#define N_KEYS 4096
+#define N_OPS 200000
+#define N_ROUNDS 2000
+#define ROUND_KEYS 2
+#define ROUND_OPS 3
+
+enum op_type { OP_INSERT, OP_REMOVE, OP_COUNT };
+
+struct op {
+    enum op_type type;
+    int key;
+    int result;
+    /* Timestamps taken just before the call and just after it returns */
+    unsigned long start, end;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    unsigned seed;
+    int failed;
+    struct op ops[ROUND_OPS];
+};
+
+static struct cbstree *tree;
+static int n_threads;
+static int n_rounds;
+static pthread_barrier_t barrier;
+static _Atomic unsigned long clock_;
+
+static int cmp_int(const void *lhs, const void *rhs)
+{
+    int l = *(const int *)lhs;
+    int r = *(const int *)rhs;
+    return (l > r) - (l < r);
+}
+
+static int *mkint(int value)
+{
+    int *p = malloc(sizeof *p);
+    *p = value;
+    return p;
+}
+
+static int rnd(unsigned *seed, int n)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) % n;
+}
+
+static int apply(enum op_type type, int key)
+{
+    switch (type) {
+    case OP_INSERT:
+        return cbstree_insert(tree, mkint(key));
+    case OP_REMOVE:
+        return cbstree_remove(tree, &key);
+    default:
+        return cbstree_count(tree, &key);
+    }
+}
+
+/* Owned keys are checked against the model, the others are only read.
+ */
+static void partitioned(struct worker *w)
+{
+    int model[N_KEYS] = { 0 };
+    int i, key, expected, result;
+    int *found;
+    enum op_type type;
+    for (i = 0; i < N_OPS; i++) {
+        key = rnd(&w->seed, N_KEYS);
+        type = rnd(&w->seed, 3);
+        if (key % n_threads != w->id) {
+            cbstree_search(tree, &key);
+            continue;
+        }
+        result = apply(type, key);
+        switch (type) {
+        case OP_INSERT:
+            expected = ++model[key];
+            break;
+        case OP_REMOVE:
+            expected = model[key];
+            model[key] = 0;
+            break;
+        default:
+            expected = model[key];
+        }
+        if (result != expected) {
+            printf("thread %d: key %d op %d returned %d instead of %d\n",
+                    w->id, key, type, result, expected);
+            w->failed = 1;
+            return;
+        }
+        /* Only this thread removes the key, so the object stays */
+        found = cbstree_search(tree, &key);
+        if ((found != NULL) != (model[key] > 0) || (found && *found != key)) {
+            printf("thread %d: key %d found %d with a count of %d\n",
+                    w->id, key, found ? *found : -1, model[key]);
+            w->failed = 1;
+            return;
+        }
+    }
+    for (key = w->id; key < N_KEYS; key += n_threads) {
+        if (cbstree_remove(tree, &key) != model[key]) {
+            w->failed = 1;
+        }
+    }
+}
+
+static void shared_inserts(struct worker *w)
+{
+    int i, key;
+    for (i = 0; i < N_KEYS; i++) {
+        key = (i * 7919 + w->id * 104729) % N_KEYS;
+        cbstree_insert(tree, mkint(key));
+    }
+}
+
+static void *run(void *arg)
+{
+    struct worker *w = arg;
+    struct op *op;
+    int round, i;
+    partitioned(w);
+    pthread_barrier_wait(&barrier);
+    /* The main thread checks the tree here */
+    pthread_barrier_wait(&barrier);
+    shared_inserts(w);
+    pthread_barrier_wait(&barrier);
+    /* The main thread checks and empties the tree here */
+    pthread_barrier_wait(&barrier);
+    for (round = 0; round < n_rounds; round++) {
+        for (i = 0; i < ROUND_OPS; i++) {
+            op = &w->ops[i];
+            op->type = rnd(&w->seed, 3);
+            op->key = rnd(&w->seed, ROUND_KEYS);
+        }
+        pthread_barrier_wait(&barrier);
+        for (i = 0; i < ROUND_OPS; i++) {
+            op = &w->ops[i];
+            op->start = atomic_fetch_add(&clock_, 1);
+            op->result = apply(op->type, op->key);
+            op->end = atomic_fetch_add(&clock_, 1);
+        }
+        pthread_barrier_wait(&barrier);
+        /* Checked by the main thread */
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+/* Try to find an order of the remaining operations that is allowed by
+ * their timestamps and explains their results, starting with 'count'.
+ */
+static int linearize(struct op **ops, int n, int *done, int count)
+{
+    unsigned long min_end = (unsigned long)-1;
+    int i, next, ok;
+    for (i = 0; i < n; i++) {
+        if (!done[i] && ops[i]->end < min_end) {
+            min_end = ops[i]->end;
+        }
+    }
+    if (min_end == (unsigned long)-1) {
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        /* Something else must have finished before this one started */
+        if (done[i] || ops[i]->start > min_end) {
+            continue;
+        }
+        switch (ops[i]->type) {
+        case OP_INSERT:
+            ok = ops[i]->result == count + 1;
+            next = count + 1;
+            break;
+        case OP_REMOVE:
+            ok = ops[i]->result == count;
+            next = 0;
+            break;
+        default:
+            ok = ops[i]->result == count;
+            next = count;
+        }
+        if (ok) {
+            done[i] = 1;
+            if (linearize(ops, n, done, next)) {
+                return 1;
+            }
+            done[i] = 0;
+        }
+    }
+    return 0;
+}
+
+static int check_round(struct worker *workers, int *counts)
+{
+    struct op *ops[MAX_THREADS * ROUND_OPS];
+    int done[MAX_THREADS * ROUND_OPS] = { 0 };
+    int key, i, j, n;
+    for (key = 0; key < ROUND_KEYS; key++) {
+        n = 0;
+        for (i = 0; i < n_threads; i++) {
+            for (j = 0; j < ROUND_OPS; j++) {
+                if (workers[i].ops[j].key == key) {
+                    ops[n++] = &workers[i].ops[j];
+                }
+            }
+        }
+        if (!linearize(ops, n, done, counts[key])) {
+            printf("key %d: history is not linearizable\n", key);
+            for (i = 0; i < n; i++) {
+                printf("  op %d returned %d in [%lu, %lu]\n", ops[i]->type,
+                        ops[i]->result, ops[i]->start, ops[i]->end);
+            }
+            return 0;
+        }
+        for (i = 0; i < n; i++) {
+            done[i] = 0;
+        }
+        counts[key] = cbstree_count(tree, &key);
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct worker workers[MAX_THREADS];
+    int counts[ROUND_KEYS] = { 0 };
+    int i, key, failed = 0;
+    n_threads = argc > 1 ? atoi(argv[1]) : 4;
+    n_rounds = argc > 2 ? atoi(argv[2]) : N_ROUNDS;
+    if (n_threads < 1 || n_threads > MAX_THREADS || n_rounds < 0) {
+        fprintf(stderr, "Usage: %s [n_threads] [n_rounds]\n", argv[0]);
+        return 1;
+    }
+    tree = cbstree_new(cmp_int, free);
+    pthread_barrier_init(&barrier, NULL, n_threads + 1);
+    for (i = 0; i < n_threads; i++) {
+        workers[i].id = i;
+        workers[i].seed = i + 1;
+        workers[i].failed = 0;
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < n_threads; i++) {
+        failed |= workers[i].failed;
+    }
+    failed |= !cbstree_valid(tree) || cbstree_size(tree) != 0;
+    printf("partitioned: %s\n", failed ? "FAILED" : "ok");
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+    /* All threads are waiting, the tree must be balanced by now */
+    failed |= !cbstree_valid(tree) || cbstree_size(tree) != N_KEYS;
+    for (key = 0; key < N_KEYS; key++) {
+        if (cbstree_remove(tree, &key) != n_threads) {
+            failed = 1;
+        }
+    }
+    printf("shared inserts: %s, size %d\n", failed ? "FAILED" : "ok",
+            cbstree_size(tree));
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < n_rounds && !failed; i++) {
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+        failed = !check_round(workers, counts);
+        pthread_barrier_wait(&barrier);
+    }
+    /* Let the rest of the rounds run unchecked if we stopped early */
+    for (; i < n_rounds; i++) {
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+    }
+    for (i = 0; i < n_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    printf("linearizability: %s\n", failed ? "FAILED" : "ok");
+    failed |= !cbstree_valid(tree);
+    printf("shape: %s\n", failed ? "FAILED" : "ok");
+    pthread_barrier_destroy(&barrier);
+    cbstree_destroy(tree);
+    return failed;
+}
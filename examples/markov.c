@@ -20,32 +20,130 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define OUT_LEN 30
+#define ARENA_BLOCK_SIZE 65536
+/* Delimiters compared at once by the vector scan, more fall back to the
+ * lookup table.
+ */
+#define MAX_VECTOR_DELIMS 8
+/* Seed of rand() unless one is given, so that runs can be compared */
+#define SEED 1
 
 struct cli_opts {
     char *initial_word;
     char *delimiter;
+    char *file;
     unsigned long out_len;
+    unsigned seed;
     int print_stats;
     int wrap;
+    int bench;
+};
+
+/* Interned strings are packed into large blocks, and are never freed
+ * individually.
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
 };
 
+/* Words are spans, not NUL terminated. They point into the arena, or into
+ * the mapped input file.
+ */
 struct word {
-    char *str;
+    const char *str;
+    size_t len;
+    unsigned id;
+    /* Transitions from this word, keyed by the ID of the next word */
     struct bstree *nextwords;
     double cnt;
 };
 
-struct random_choice {
-    struct word *word;
-    double rnd;
-    double sum;
+struct transition {
+    unsigned id;
+    double cnt;
+};
+
+/* Every distinct word is interned once, and is then referred to by its
+ * ID, which is an index into 'words'. The 'dict' is only used to map
+ * strings to words while reading the input, it has a hash index so that
+ * doing so takes a single string comparison.
+ */
+struct model {
+    struct bstree *dict;
+    struct word **words;
+    unsigned nwords;
+    unsigned capacity;
+    struct arena_block *arena;
+    /* The input file, if it was mapped */
+    void *map;
+    size_t map_len;
+    size_t ntokens;
+    /* With -b, the IDs of the words in input order, so that counting the
+     * transitions is timed apart from reading the input.
+     */
+    unsigned *tokens;
+    size_t tokens_cap;
+    int record;
+};
+
+/* State of the measurements taken with -b */
+struct bench {
+    /* Start of the phase being measured */
+    double start;
+    /* Bytes of the word IDs recorded for the build phase, which a run
+     * without -b does not have. They are left out of the peaks reported.
+     */
+    size_t ids;
+};
+
+/* One slot of a Walker alias table. A row with n successors is sampled by
+ * picking a slot uniformly, then taking 'next' with probability 'prob'
+ * and 'alias' otherwise. Both are IDs, i.e. row numbers of the chain.
+ */
+struct alias_slot {
+    double prob;
+    unsigned next;
+    unsigned alias;
+};
+
+/* The model frozen in compressed sparse row form. Successors of the word
+ * with ID i are slots[row[i]] to slots[row[i + 1] - 1].
+ */
+struct chain {
+    unsigned *row;
+    struct alias_slot *slots;
+};
+
+struct row_builder {
+    struct transition **succ;
+    unsigned n;
+};
+
+/* The delimiter set, as a table and as vectors of repeated bytes */
+struct delims {
+    unsigned char table[256];
+#ifdef __SSE2__
+    __m128i vectors[MAX_VECTOR_DELIMS];
+    /* 0 if there are too many delimiters for the vectors */
+    int n;
+#endif
 };
 
 static double uniform_rnd(void)
@@ -53,63 +151,206 @@ static double uniform_rnd(void)
     return (double)rand() / (double)RAND_MAX;
 }
 
-static int choose_word(void *currp, void *choicep)
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Return the peak resident set size in kB, or -1 if it is not known.
+ */
+static long peak_rss(void)
+{
+    char line[128];
+    long kb = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof line, f)) {
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/* Start measuring a phase. The peak RSS is reset so that it covers the
+ * phase alone. Where that is not supported it stays the peak of the whole
+ * run so far.
+ */
+static void phase_begin(struct bench *bench)
+{
+    int fd;
+    if (!bench) {
+        return;
+    }
+    fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) < 0) {
+            /* Keep the peak of the run so far */
+        }
+        close(fd);
+    }
+    bench->start = now();
+}
+
+/* Report the phase on the standard error, and return how long it took.
+ */
+static double phase_end(struct bench *bench, const char *name)
 {
-    struct word *curr = currp;
-    struct random_choice *choice = choicep;
-    if (choice->sum < choice->rnd) {
-        choice->word = curr;
-        choice->sum += curr->cnt;
+    double elapsed;
+    long peak;
+    if (!bench) {
         return 0;
-    } else {
-        return 1;
     }
+    elapsed = now() - bench->start;
+    peak = peak_rss();
+    if (peak >= 0) {
+        peak -= bench->ids / 1024;
+    }
+    fprintf(stderr, "%-10s %10.3f s %10ld kB\n", name, elapsed, peak);
+    return elapsed;
 }
 
-static struct word *choose_next(struct word *curr)
+static char *arena_copy(struct model *model, const char *str, size_t len)
 {
-    struct random_choice choice = { NULL, uniform_rnd(), 0 };
-    bstree_traverse_inorder(curr->nextwords, &choice, choose_word);
-    return choice.word;
+    struct arena_block *block = model->arena;
+    char *copy;
+    if (!block || block->size - block->used < len) {
+        size_t size = len > ARENA_BLOCK_SIZE ? len : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof *block + size);
+        block->next = model->arena;
+        block->used = 0;
+        block->size = size;
+        model->arena = block;
+    }
+    copy = block->data + block->used;
+    memcpy(copy, str, len);
+    block->used += len;
+    return copy;
 }
 
 static int cmp_word(const void *lhs, const void *rhs)
 {
-    return strcmp(((struct word *)lhs)->str, ((struct word *)rhs)->str);
+    const struct word *l = lhs;
+    const struct word *r = rhs;
+    int cmp = memcmp(l->str, r->str, l->len < r->len ? l->len : r->len);
+    if (cmp) {
+        return cmp;
+    }
+    return (l->len > r->len) - (l->len < r->len);
+}
+
+/* FNV-1a */
+static unsigned long hash_word(const void *p)
+{
+    const struct word *word = p;
+    const unsigned char *str = (const unsigned char *)word->str;
+    unsigned long hash = 2166136261UL;
+    size_t i;
+    for (i = 0; i < word->len; i++) {
+        hash = (hash ^ str[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+static int cmp_transition(const void *lhs, const void *rhs)
+{
+    unsigned l = ((const struct transition *)lhs)->id;
+    unsigned r = ((const struct transition *)rhs)->id;
+    return (l > r) - (l < r);
 }
 
 static void free_word(void *p)
 {
     struct word *word = p;
     bstree_destroy(word->nextwords);
-    free(word->str);
     free(word);
 }
 
-static struct word *mkword(char *str)
+static struct model *mkmodel(void)
+{
+    struct model *model = malloc(sizeof *model);
+    model->dict = bstree_new_hashed(cmp_word, hash_word, free_word);
+    model->words = NULL;
+    model->nwords = 0;
+    model->capacity = 0;
+    model->arena = NULL;
+    model->map = NULL;
+    model->map_len = 0;
+    model->ntokens = 0;
+    model->tokens = NULL;
+    model->tokens_cap = 0;
+    model->record = 0;
+    return model;
+}
+
+static void free_model(struct model *model)
 {
-    struct word *w = malloc(sizeof *w);
-    w->str = strdup(str);
-    w->nextwords = bstree_new(cmp_word, free_word);
-    w->cnt = 1;
-    return w;
+    struct arena_block *block, *next;
+    bstree_destroy(model->dict);
+    for (block = model->arena; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    if (model->map) {
+        munmap(model->map, model->map_len);
+    }
+    free(model->words);
+    free(model->tokens);
+    free(model);
+}
+
+/* Return the ID of the given word, interning it if it is seen
+ * for the first time. The word is copied to the arena unless it is in
+ * the mapped input, which lives as long as the model.
+ */
+static unsigned intern(struct model *model, const char *str, size_t len)
+{
+    struct word key;
+    struct word *w;
+    key.str = str;
+    key.len = len;
+    w = bstree_search(model->dict, &key);
+    if (w) {
+        return w->id;
+    }
+    if (model->nwords == model->capacity) {
+        model->capacity = model->capacity ? model->capacity * 2 : 1024;
+        model->words = realloc(model->words,
+                model->capacity * sizeof *model->words);
+    }
+    w = malloc(sizeof *w);
+    w->str = model->map ? str : arena_copy(model, str, len);
+    w->len = len;
+    w->id = model->nwords++;
+    w->nextwords = bstree_new(cmp_transition, free);
+    w->cnt = 0;
+    model->words[w->id] = w;
+    bstree_insert(model->dict, w);
+    return w->id;
 }
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
-static int print_word(void *p, void *it_data)
+static int print_transition(void *p, void *it_data)
 {
-    struct word *w = p;
-    printf("    %s : %.2f\n", w->str, w->cnt);
+    struct transition *t = p;
+    struct model *model = it_data;
+    struct word *word = model->words[t->id];
+    printf("    %.*s : %.2f\n", (int)word->len, word->str, t->cnt);
     return 0;
 }
 
 static int print_tree(void *p, void *it_data)
 {
     struct word *word = p;
-    printf("%s\n", word->str);
-    bstree_traverse_inorder(word->nextwords, NULL, print_word);
+    printf("%.*s\n", (int)word->len, word->str);
+    bstree_traverse_inorder(word->nextwords, it_data, print_transition);
     return 0;
 }
 
@@ -117,57 +358,149 @@ static int print_tree(void *p, void *it_data)
 
 static int normalize_counts(void *p, void *it_data)
 {
-    struct word *word = p;
-    word->cnt /= *(double *)it_data;
+    struct transition *t = p;
+    t->cnt /= *(double *)it_data;
     return 0;
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void normalize_transitions(struct model *model)
+{
+    unsigned i;
+    for (i = 0; i < model->nwords; i++) {
+        struct word *word = model->words[i];
+        double sum = word->cnt;
+        bstree_traverse_inorder(word->nextwords, &sum, normalize_counts);
+    }
+}
 
-static int normalize_transitions(void *p, void *it_data)
+static void add_transition(struct model *model, unsigned curr, unsigned next)
 {
-    struct word *word;
-    double sum;
-    word = p;
-    sum = word->cnt;
-    bstree_traverse_inorder(word->nextwords, &sum, normalize_counts);
+    struct transition key;
+    struct transition *t;
+    struct word *word = model->words[curr];
+    word->cnt++;
+    key.id = next;
+    t = bstree_search(word->nextwords, &key);
+    if (!t) {
+        t = malloc(sizeof *t);
+        t->id = next;
+        t->cnt = 1;
+        bstree_insert(word->nextwords, t);
+    } else {
+        t->cnt++;
+    }
+}
+
+static int collect_transition(void *p, void *it_data)
+{
+    struct row_builder *rb = it_data;
+    rb->succ[rb->n++] = p;
     return 0;
 }
 
-#pragma GCC diagnostic pop
+/* Fill the alias table for one row using Vose's method, 'work' must have
+ * room for n entries.
+ */
+static void build_alias_row(struct alias_slot *slots,
+        struct transition **succ, unsigned n, unsigned *work)
+{
+    unsigned i, nsmall, nlarge, s, l;
+    nsmall = 0;
+    nlarge = n;
+    for (i = 0; i < n; i++) {
+        slots[i].prob = succ[i]->cnt * n;
+        slots[i].next = succ[i]->id;
+        slots[i].alias = succ[i]->id;
+        if (slots[i].prob < 1) {
+            work[nsmall++] = i;
+        } else {
+            work[--nlarge] = i;
+        }
+    }
+    /* Small ones grow from the front of work, large ones from the back */
+    while (nsmall > 0 && nlarge < n) {
+        s = work[--nsmall];
+        l = work[nlarge];
+        slots[s].alias = slots[l].next;
+        slots[l].prob -= 1 - slots[s].prob;
+        if (slots[l].prob < 1) {
+            nlarge++;
+            work[nsmall++] = l;
+        }
+    }
+    /* Whatever is left is 1 up to rounding errors */
+    while (nlarge < n) {
+        slots[work[nlarge++]].prob = 1;
+    }
+    while (nsmall > 0) {
+        slots[work[--nsmall]].prob = 1;
+    }
+}
 
-static void add_transition(struct bstree *table, char *curr, char *next)
+/* Freeze the normalized model. Generating from the result takes constant
+ * time per word and does not touch the trees.
+ */
+static struct chain *compile_chain(struct model *model)
 {
-    struct word key;
-    struct word *word, *nextword;
-    key.str = curr;
-    word = bstree_search(table, &key);
-    if (!word) {
-        word = mkword(curr);
-        bstree_insert(table, word);
-    } else {
-        word->cnt++;
+    struct chain *chain = malloc(sizeof *chain);
+    struct row_builder rb;
+    unsigned i, nslots, maxdeg, *work;
+    chain->row = malloc((model->nwords + 1) * sizeof *chain->row);
+    for (i = 0, nslots = 0, maxdeg = 0; i < model->nwords; i++) {
+        unsigned deg = bstree_size(model->words[i]->nextwords);
+        chain->row[i] = nslots;
+        nslots += deg;
+        if (deg > maxdeg) {
+            maxdeg = deg;
+        }
     }
-    key.str = next;
-    nextword = bstree_search(word->nextwords, &key);
-    if (!nextword) {
-        nextword = mkword(next);
-        bstree_insert(word->nextwords, nextword);
-    } else {
-        nextword->cnt++;
+    chain->row[model->nwords] = nslots;
+    chain->slots = malloc(nslots * sizeof *chain->slots);
+    rb.succ = malloc(maxdeg * sizeof *rb.succ);
+    work = malloc(maxdeg * sizeof *work);
+    for (i = 0; i < model->nwords; i++) {
+        rb.n = 0;
+        bstree_traverse_inorder(model->words[i]->nextwords, &rb,
+                collect_transition);
+        build_alias_row(chain->slots + chain->row[i], rb.succ, rb.n, work);
     }
+    free(work);
+    free(rb.succ);
+    return chain;
+}
+
+static void free_chain(struct chain *chain)
+{
+    free(chain->slots);
+    free(chain->row);
+    free(chain);
+}
+
+static unsigned chain_next(const struct chain *chain, unsigned curr)
+{
+    unsigned first = chain->row[curr];
+    unsigned n = chain->row[curr + 1] - first;
+    double u = uniform_rnd() * n;
+    unsigned k = u < n ? (unsigned)u : n - 1;
+    const struct alias_slot *slot = &chain->slots[first + k];
+    return u - k < slot->prob ? slot->next : slot->alias;
 }
 
 static void print_usage(char **argv)
 {
     fprintf(stderr, "Usage: %s -i initial_word [-l out_len] [-t]"
-            " [-d delimiter] [-w]\n", argv[0]);
+            " [-d delimiter] [-w] [-f file] [-s seed] [-b]\n", argv[0]);
     fprintf(stderr, "-l\t\tLength (in words) of the generated sequence\n");
     fprintf(stderr, "-i\t\tInitial word of the sequence\n");
     fprintf(stderr, "-t\t\tPrint the transition statistics\n");
     fprintf(stderr, "-d delimiter\tWord delimiter string, default is space\n");
     fprintf(stderr, "-w\t\tWrap output if longer than 80 characters\n");
+    fprintf(stderr, "-f file\t\tRead the text from the file instead of the"
+            " standard input,\n\t\twithout copying it\n");
+    fprintf(stderr, "-s seed\t\tSeed of the generator, default is %d\n",
+            SEED);
+    fprintf(stderr, "-b\t\tReport the time and peak memory of each phase"
+            " on the\n\t\tstandard error\n");
 }
 
 /* Parse the command line options and place them in opts.
@@ -181,7 +514,10 @@ static int parse_opts(int argc, char **argv, struct cli_opts *opts)
     opts->print_stats = 0;
     opts->wrap = 0;
     opts->delimiter = " ";
-    while ((opt = getopt(argc, argv, "l:i:d:tw")) != -1) {
+    opts->file = NULL;
+    opts->seed = SEED;
+    opts->bench = 0;
+    while ((opt = getopt(argc, argv, "l:i:d:tf:ws:b")) != -1) {
         switch (opt) {
             case 'l':
                 opts->out_len = strtoul(optarg, NULL, 10);
@@ -207,6 +543,23 @@ static int parse_opts(int argc, char **argv, struct cli_opts *opts)
             case 'w':
                 opts->wrap = 1;
                 break;
+            case 'f':
+                opts->file = optarg;
+                break;
+            case 's': {
+                unsigned long seed;
+                char *end;
+                errno = 0;
+                seed = strtoul(optarg, &end, 10);
+                if (errno || *end || end == optarg || seed > UINT_MAX) {
+                    return 1;
+                }
+                opts->seed = seed;
+                break;
+            }
+            case 'b':
+                opts->bench = 1;
+                break;
             default:
                 return 1;
         }
@@ -215,94 +568,284 @@ static int parse_opts(int argc, char **argv, struct cli_opts *opts)
     return !opts->initial_word;
 }
 
-static struct bstree *generate_transition_table(struct cli_opts *opts)
+/* Count the word as following the previous one, if there is one. When
+ * recording, only keep its ID for add_transitions to count later.
+ */
+static void add_word(struct model *model, long *curr, const char *str,
+        size_t len)
+{
+    unsigned id = intern(model, str, len);
+    model->ntokens++;
+    if (model->record) {
+        if (model->ntokens > model->tokens_cap) {
+            model->tokens_cap = model->tokens_cap
+                ? model->tokens_cap * 2 : 65536;
+            model->tokens = realloc(model->tokens,
+                    model->tokens_cap * sizeof *model->tokens);
+        }
+        model->tokens[model->ntokens - 1] = id;
+    } else if (*curr >= 0) {
+        add_transition(model, *curr, id);
+    }
+    *curr = id;
+}
+
+/* Count the transitions between the recorded words.
+ */
+static void add_transitions(struct model *model)
+{
+    size_t i;
+    for (i = 1; i < model->ntokens; i++) {
+        add_transition(model, model->tokens[i - 1], model->tokens[i]);
+    }
+    free(model->tokens);
+    model->tokens = NULL;
+    model->tokens_cap = 0;
+}
+
+static void read_stdin(struct model *model, struct cli_opts *opts,
+        long *curr)
 {
     char *line;
     size_t bufsize;
     ssize_t read_len;
-    char *curr, *next;
-    struct bstree *table;
-    table = bstree_new(cmp_word, free_word);
-    for (curr = NULL, line = NULL, bufsize = 0;
+    char *next;
+    for (line = NULL, bufsize = 0;
             (read_len = getline(&line, &bufsize, stdin)) != EOF; ) {
         if (line[read_len - 1] == '\n') {
             line[read_len - 1] = '\0';
         }
         next = strtok(line, opts->delimiter);
         while (next) {
-            if (curr) {
-                add_transition(table, curr, next);
-                free(curr);
-            }
-            curr = strdup(next);
+            add_word(model, curr, next, strlen(next));
             next = strtok(NULL, opts->delimiter);
         }
     }
-    if (!curr) {
-        /* Empty input */
-        free(line);
-        return table;
-    }
-    /* Add a transition from the last word to itself */
-    add_transition(table, curr, curr);
-    bstree_traverse_inorder(table, NULL, normalize_transitions);
-    free(curr);
     free(line);
-    return table;
 }
 
-static void print_transition_table(struct bstree *table)
+/* Line breaks always end words, as they do when reading lines from the
+ * standard input.
+ */
+static void mkdelims(struct delims *d, const char *delimiter)
+{
+    const unsigned char *c;
+    memset(d->table, 0, sizeof d->table);
+    d->table['\n'] = 1;
+    for (c = (const unsigned char *)delimiter; *c; c++) {
+        d->table[*c] = 1;
+    }
+#ifdef __SSE2__
+    {
+        int i;
+        d->n = 0;
+        for (i = 0; i < 256; i++) {
+            if (!d->table[i]) {
+                continue;
+            }
+            if (d->n == MAX_VECTOR_DELIMS) {
+                d->n = 0;
+                break;
+            }
+            d->vectors[d->n++] = _mm_set1_epi8((char)i);
+        }
+    }
+#endif
+}
+
+/* Return the first position from p on where a delimiter is (if 'delim' is
+ * set) or is not, end if there is none. Takes 16 bytes at a time while
+ * there are that many left.
+ */
+static const char *scan(const struct delims *d, const char *p,
+        const char *end, int delim)
+{
+#ifdef __SSE2__
+    __m128i block, hit;
+    unsigned mask;
+    int i;
+    if (d->n) {
+        for (; end - p >= 16; p += 16) {
+            block = _mm_loadu_si128((const __m128i *)p);
+            hit = _mm_cmpeq_epi8(block, d->vectors[0]);
+            for (i = 1; i < d->n; i++) {
+                hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, d->vectors[i]));
+            }
+            mask = (unsigned)_mm_movemask_epi8(hit);
+            if (!delim) {
+                mask = ~mask & 0xffff;
+            }
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+    while (p < end && d->table[(unsigned char)*p] != delim) {
+        p++;
+    }
+    return p;
+}
+
+/* Map the input file and take the words right out of it.
+ * Returns nonzero on failure.
+ */
+static int read_file(struct model *model, struct cli_opts *opts, long *curr)
 {
-    bstree_traverse_inorder(table, NULL, print_tree);
+    struct delims d;
+    struct stat st;
+    const char *p, *q, *end;
+    int fd = open(opts->file, O_RDONLY);
+    if (fd < 0) {
+        perror(opts->file);
+        return 1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror(opts->file);
+        close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    model->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (model->map == MAP_FAILED) {
+        model->map = NULL;
+        perror(opts->file);
+        return 1;
+    }
+    model->map_len = st.st_size;
+    madvise(model->map, model->map_len, MADV_SEQUENTIAL);
+    mkdelims(&d, opts->delimiter);
+    end = (const char *)model->map + model->map_len;
+    for (p = model->map; (p = scan(&d, p, end, 0)) < end; p = q) {
+        q = scan(&d, p, end, 1);
+        add_word(model, curr, p, q - p);
+    }
+    return 0;
 }
 
-static void generate_chain(struct bstree *table, struct cli_opts *opts)
+/* Returns NULL if the input could not be read. If bench is not NULL, the
+ * words are read before any transition is counted, and each is reported
+ * as a phase.
+ */
+static struct model *generate_transition_table(struct cli_opts *opts,
+        struct bench *bench)
+{
+    long curr = -1;
+    struct model *model;
+    phase_begin(bench);
+    model = mkmodel();
+    model->record = bench != NULL;
+    if (opts->file) {
+        if (read_file(model, opts, &curr)) {
+            free_model(model);
+            return NULL;
+        }
+    } else {
+        read_stdin(model, opts, &curr);
+    }
+    if (bench) {
+        bench->ids = model->tokens_cap * sizeof *model->tokens;
+        fprintf(stderr, "peaks of tokenize and build leave out the %zu kB"
+                " of word IDs kept for -b\n", bench->ids / 1024);
+    }
+    phase_end(bench, "tokenize");
+    phase_begin(bench);
+    if (model->record) {
+        add_transitions(model);
+    }
+    if (curr >= 0) {
+        /* Add a transition from the last word to itself */
+        add_transition(model, curr, curr);
+    }
+    phase_end(bench, "build");
+    if (bench) {
+        /* add_transitions freed them */
+        bench->ids = 0;
+    }
+    phase_begin(bench);
+    normalize_transitions(model);
+    phase_end(bench, "normalize");
+    return model;
+}
+
+static void print_transition_table(struct model *model)
+{
+    bstree_traverse_inorder(model->dict, model, print_tree);
+}
+
+/* Returns the number of words generated.
+ */
+static unsigned long generate_chain(struct model *model,
+        struct cli_opts *opts)
 {
     struct word *initial;
     struct word key_word;
+    struct chain *chain;
     unsigned long i, line_len;
-    if (bstree_size(table) == 0) {
+    unsigned curr;
+    if (model->nwords == 0) {
         /* Empty input */
-        return;
+        return 0;
     }
     key_word.str = opts->initial_word;
-    for (i = 0, line_len = 0; i < opts->out_len; i++) {
-        initial = bstree_search(table, &key_word);
-        if (!initial) {
-            if (i == 0 && opts->initial_word) {
-                fprintf(stderr, "Initial word not found in dictionary."
-                        " Make sure you have supplied a word that really exists"
-                        " in the text.\n");
-            } else {
-                /* Oh, well... */
-                fprintf(stderr, "This error does not exist.\n");
-            }
-            break;
-        }
+    key_word.len = strlen(opts->initial_word);
+    initial = bstree_search(model->dict, &key_word);
+    if (!initial) {
+        fprintf(stderr, "Initial word not found in dictionary."
+                " Make sure you have supplied a word that really exists"
+                " in the text.\n");
+        putchar('\n');
+        return 0;
+    }
+    chain = compile_chain(model);
+    for (i = 0, line_len = 0, curr = initial->id; i < opts->out_len; i++) {
         if (opts->wrap && line_len >= 80) {
             putchar('\n');
             line_len = 0;
         }
-        line_len += printf("%s%s", initial->str, opts->delimiter);
-        key_word.str = choose_next(initial)->str;
+        line_len += printf("%.*s%s", (int)model->words[curr]->len,
+                model->words[curr]->str, opts->delimiter);
+        curr = chain_next(chain, curr);
     }
     putchar('\n');
+    free_chain(chain);
+    return i;
 }
 
 int main(int argc, char **argv)
 {
-    struct bstree *table;
+    struct model *model;
     struct cli_opts opts;
+    struct bench bench_state = { 0, 0 };
+    struct bench *bench;
+    unsigned long generated;
+    double elapsed;
     if (parse_opts(argc, argv, &opts)) {
         print_usage(argv);
         return 1;
     }
-    srand(time(NULL));
-    table = generate_transition_table(&opts);
+    srand(opts.seed);
+    bench = opts.bench ? &bench_state : NULL;
+    model = generate_transition_table(&opts, bench);
+    if (!model) {
+        return 1;
+    }
     if (opts.print_stats) {
-        print_transition_table(table);
+        print_transition_table(model);
+    }
+    phase_begin(bench);
+    generated = generate_chain(model, &opts);
+    fflush(stdout);
+    elapsed = phase_end(bench, "generate");
+    if (bench) {
+        fprintf(stderr, "tokens %zu, words %u, generated %lu, %.0f tokens/s\n",
+                model->ntokens, model->nwords, generated,
+                elapsed > 0 ? generated / elapsed : 0);
     }
-    generate_chain(table, &opts);
-    bstree_destroy(table);
+    free_model(model);
     return 0;
 }
@@ -18,10 +18,19 @@
 
 #include "bstree.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define ARR_SIZE 16
+#define CHUNK_SIZE 4
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
 
 struct int_arr {
     int *arr;
@@ -29,6 +38,16 @@ struct int_arr {
     int size;
 };
 
+static int failures;
+
+void check(int ok, const char *what, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "FAILED (line %d): %s\n", line, what);
+        failures++;
+    }
+}
+
 int cmp_int(const void *lhs, const void *rhs)
 {
     return *((const int *)lhs) - *((const int *)rhs);
@@ -66,6 +85,25 @@ int sum_int_lt_5(void *ptr, void *it_data)
     }
 }
 
+int sum_int_chunk(void **objects, int *counts, int n, void *it_data)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        *(int *)it_data += *(int *)objects[i] * counts[i];
+    }
+    return 0;
+}
+
+void sum_leaf(void *agg, const void *object, int count)
+{
+    *(int *)agg = *(const int *)object * count;
+}
+
+void sum_combine(void *agg, const void *lhs, const void *rhs)
+{
+    *(int *)agg = *(const int *)lhs + *(const int *)rhs;
+}
+
 int mk_array(void *ptr, void *it_data)
 {
     struct int_arr *elements = it_data;
@@ -77,19 +115,1042 @@ int mk_array(void *ptr, void *it_data)
     return 0;
 }
 
+int *new_int(int value)
+{
+    int *p = malloc(sizeof *p);
+    *p = value;
+    return p;
+}
+
+/* Return whether the traversal visits exactly the expected values.
+ */
+int visits(struct bstree *tree,
+        int (*traverse)(const struct bstree *tree, void *it_data,
+            int (*operation)(void *object, void *it_data)),
+        const int *expected, int n)
+{
+    struct int_arr elements = { malloc(sizeof(int)), -1, 1 };
+    int i, same;
+    traverse(tree, &elements, mk_array);
+    same = elements.last == n - 1;
+    for (i = 0; same && i < n; i++) {
+        same = elements.arr[i] == expected[i];
+    }
+    free(elements.arr);
+    return same;
+}
+
+/* Trees made by bstree_new and bstree_new_wavl keep up to 4 objects in an
+ * array, which must look like the balanced tree it spills into.
+ */
+void test_small(struct bstree *(*new)(
+            int (*compare_object)(const void *lhs, const void *rhs),
+            void (*free_object)(void *object)))
+{
+    struct bstree *tree = new(cmp_int, free_int);
+    const int in3[] = { 1, 2, 3 }, pre3[] = { 2, 1, 3 }, post3[] = { 1, 3, 2 };
+    const int pre4[] = { 3, 2, 1, 4 }, post4[] = { 1, 2, 4, 3 };
+    const int in5[] = { 1, 2, 3, 4, 5 }, pre5[] = { 3, 2, 1, 4, 5 };
+    const int in_cnt[] = { 1, 2, 2, 3, 4 }, in2[] = { 2, 4 };
+    void *chunk[CHUNK_SIZE];
+    int counts[CHUNK_SIZE];
+    int i, n, removed, sum = 0;
+    int *p;
+    CHECK(bstree_height(tree) == -1);
+    for (i = 3; i >= 1; i--) {
+        bstree_insert(tree, new_int(i));
+    }
+    CHECK(bstree_height(tree) == 1);
+    CHECK(visits(tree, bstree_traverse_inorder, in3, 3));
+    CHECK(visits(tree, bstree_traverse_preorder, pre3, 3));
+    CHECK(visits(tree, bstree_traverse_postorder, post3, 3));
+    bstree_insert(tree, new_int(4));
+    CHECK(bstree_height(tree) == 2);
+    CHECK(visits(tree, bstree_traverse_preorder, pre4, 4));
+    CHECK(visits(tree, bstree_traverse_postorder, post4, 4));
+    /* Counts stay with their objects */
+    bstree_insert(tree, new_int(2));
+    CHECK(bstree_count(tree, &(int){ 2 }) == 2);
+    CHECK(bstree_size(tree) == 4);
+    CHECK(visits(tree, bstree_traverse_inorder_cnt, in_cnt, 5));
+    errno = 0;
+    CHECK(bstree_traverse_chunks(tree, BSTREE_INORDER, chunk, counts, 0,
+                &sum, sum_int_chunk) == -1 && errno == EINVAL);
+    /* The 5th distinct object spills the array into nodes */
+    bstree_insert(tree, new_int(5));
+    CHECK(bstree_size(tree) == 5);
+    CHECK(bstree_height(tree) == 2);
+    CHECK(bstree_count(tree, &(int){ 2 }) == 2);
+    CHECK(visits(tree, bstree_traverse_inorder, in5, 5));
+    CHECK(visits(tree, bstree_traverse_preorder, pre5, 5));
+    errno = 0;
+    CHECK(bstree_traverse_chunks(tree, BSTREE_PREORDER, chunk, counts, -1,
+                &sum, sum_int_chunk) == -1 && errno == EINVAL);
+    bstree_destroy(tree);
+    /* Pops and removals below the capacity */
+    tree = new(cmp_int, free_int);
+    for (i = 1; i <= 4; i++) {
+        bstree_insert(tree, new_int(i));
+    }
+    bstree_insert(tree, new_int(1));
+    p = bstree_pop_min(tree, &removed);
+    CHECK(*p == 1 && !removed && bstree_count(tree, p) == 1);
+    p = bstree_pop_min(tree, &removed);
+    CHECK(*p == 1 && removed && bstree_count(tree, p) == 0);
+    free(p);
+    p = bstree_pop_max(tree, NULL);
+    CHECK(*p == 4 && bstree_size(tree) == 2);
+    free(p);
+    n = 3;
+    bstree_remove(tree, &n);
+    n = 42;
+    bstree_remove(tree, &n);
+    CHECK(bstree_size(tree) == 1 && bstree_height(tree) == 0);
+    bstree_insert(tree, new_int(4));
+    CHECK(visits(tree, bstree_traverse_inorder, in2, 2));
+    CHECK(*(int *)bstree_min(tree) == 2 && *(int *)bstree_max(tree) == 4);
+    /* Up to 5 again, then back down through the nodes */
+    for (i = 5; i <= 7; i++) {
+        bstree_insert(tree, new_int(i));
+    }
+    CHECK(bstree_size(tree) == 5);
+    for (i = 2; i <= 7; i++) {
+        n = i;
+        bstree_remove(tree, &n);
+    }
+    CHECK(bstree_size(tree) == 0 && bstree_height(tree) == -1);
+    CHECK(bstree_pop_min(tree, &removed) == NULL && !removed);
+    CHECK(bstree_min(tree) == NULL);
+    bstree_destroy(tree);
+}
+
+/* Removing 1 from 3 (2 (1), 7 (5 (4), 8 (-, 9))) leaves the root right
+ * heavy, with the children of 7 equally tall. Only a single rotation
+ * balances that. Augmented trees are used as they do not start small, so
+ * the inserts below build exactly that shape.
+ */
+void test_remove_rebalance(void)
+{
+    struct bstree *tree = bstree_new_augmented(cmp_int, free_int,
+            sizeof(int), sum_leaf, sum_combine);
+    const int keys[] = { 3, 2, 7, 1, 5, 8, 4, 9 };
+    const int pre[] = { 3, 2, 1, 7, 5, 4, 8, 9 };
+    const int pre_after[] = { 7, 3, 2, 5, 4, 8, 9 };
+    int i, n = 1, sum = 0, lo = 0, hi = 10;
+    for (i = 0; i < 8; i++) {
+        bstree_insert(tree, new_int(keys[i]));
+    }
+    CHECK(visits(tree, bstree_traverse_preorder, pre, 8));
+    bstree_remove(tree, &n);
+    CHECK(visits(tree, bstree_traverse_preorder, pre_after, 7));
+    CHECK(bstree_height(tree) == 3);
+    CHECK(bstree_range_aggregate(tree, &lo, &hi, &sum) && sum == 38);
+    bstree_destroy(tree);
+}
+
+/* Removing 3 from 3 (2 (1), 5 (4, 6 (-, 7))) puts its successor 4 in its
+ * place, and 4 must keep its own count, not take that of 3.
+ */
+void test_remove_count(void)
+{
+    struct bstree *tree = bstree_new(cmp_int, free_int);
+    const int pre[] = { 3, 2, 1, 5, 4, 6, 7 };
+    const int in_cnt[] = { 1, 2, 4, 4, 4, 5, 6, 7 };
+    int i, n = 3;
+    for (i = 1; i <= 7; i++) {
+        bstree_insert(tree, new_int(i));
+    }
+    CHECK(visits(tree, bstree_traverse_preorder, pre, 7));
+    bstree_insert(tree, new_int(4));
+    bstree_insert(tree, new_int(4));
+    bstree_remove(tree, &n);
+    CHECK(bstree_count(tree, &n) == 0);
+    n = 4;
+    CHECK(bstree_count(tree, &n) == 3);
+    CHECK(visits(tree, bstree_traverse_inorder_cnt, in_cnt, 8));
+    bstree_destroy(tree);
+}
+
+#define FAT_KEYS 200
+
+/* Enough objects for fat nodes to fill up, split and merge again. */
+void test_fat(void)
+{
+    struct bstree *tree = bstree_new_fat(cmp_int, free_int);
+    int expected[FAT_KEYS * 2];
+    void *chunk[CHUNK_SIZE];
+    int counts[CHUNK_SIZE];
+    int i, j, n, sum, removed;
+    int *p;
+    for (i = 0; i < FAT_KEYS; i++) {
+        bstree_insert(tree, new_int(i * 37 % FAT_KEYS));
+    }
+    for (i = 0; i < FAT_KEYS; i += 2) {
+        bstree_insert(tree, new_int(i));
+    }
+    CHECK(bstree_size(tree) == FAT_KEYS);
+    CHECK(bstree_height(tree) >= 1 && bstree_height(tree) <= 5);
+    n = 10;
+    CHECK(bstree_count(tree, &n) == 2);
+    n = 11;
+    CHECK(bstree_count(tree, &n) == 1 && *(int *)bstree_search(tree, &n) == 11);
+    n = FAT_KEYS;
+    CHECK(bstree_count(tree, &n) == 0 && bstree_search(tree, &n) == NULL);
+    for (i = 0, j = 0; i < FAT_KEYS; i++) {
+        expected[j++] = i;
+        if (i % 2 == 0) {
+            expected[j++] = i;
+        }
+    }
+    CHECK(visits(tree, bstree_traverse_inorder_cnt, expected, j));
+    for (i = 0; i < FAT_KEYS; i++) {
+        expected[i] = i;
+    }
+    CHECK(visits(tree, bstree_traverse_inorder, expected, FAT_KEYS));
+    /* Every object once in the other orders as well */
+    sum = 0;
+    bstree_traverse_preorder(tree, &sum, sum_int);
+    CHECK(sum == FAT_KEYS * (FAT_KEYS - 1) / 2);
+    sum = 0;
+    bstree_traverse_postorder(tree, &sum, sum_int);
+    CHECK(sum == FAT_KEYS * (FAT_KEYS - 1) / 2);
+    sum = 0;
+    bstree_traverse_chunks(tree, BSTREE_POSTORDER, chunk, counts, CHUNK_SIZE,
+            &sum, sum_int_chunk);
+    CHECK(sum == FAT_KEYS * (FAT_KEYS - 1) / 2 + 99 * 100);
+    errno = 0;
+    CHECK(bstree_traverse_chunks(tree, BSTREE_INORDER, chunk, counts, 0,
+                &sum, sum_int_chunk) == -1 && errno == EINVAL);
+    /* Remove the multiples of 3, in no particular order */
+    for (i = 0; i < FAT_KEYS; i++) {
+        n = i * 37 % FAT_KEYS;
+        if (n % 3 == 0) {
+            bstree_remove(tree, &n);
+        }
+    }
+    n = FAT_KEYS;
+    bstree_remove(tree, &n);
+    for (i = 0, j = 0; i < FAT_KEYS; i++) {
+        if (i % 3) {
+            expected[j++] = i;
+        }
+    }
+    CHECK(bstree_size(tree) == j);
+    CHECK(visits(tree, bstree_traverse_inorder, expected, j));
+    CHECK(*(int *)bstree_min(tree) == 1);
+    CHECK(*(int *)bstree_max(tree) == FAT_KEYS - 1);
+    p = bstree_pop_min(tree, &removed);
+    CHECK(*p == 1 && removed);
+    free(p);
+    p = bstree_pop_min(tree, &removed);
+    CHECK(*p == 2 && !removed && bstree_count(tree, p) == 1);
+    /* Down to nothing */
+    for (i = 0; i < FAT_KEYS; i++) {
+        bstree_remove(tree, &i);
+    }
+    CHECK(bstree_size(tree) == 0 && bstree_height(tree) == -1);
+    CHECK(bstree_min(tree) == NULL);
+    bstree_destroy(tree);
+}
+
+#define WAVL_KEYS 1000
+
+/* Return whether the two trees have the same shape and objects.
+ */
+int same_shape(struct bstree *lhs, struct bstree *rhs)
+{
+    struct int_arr elements = { malloc(sizeof(int)), -1, 1 };
+    int same;
+    bstree_traverse_preorder(lhs, &elements, mk_array);
+    same = visits(rhs, bstree_traverse_preorder, elements.arr,
+            elements.last + 1);
+    free(elements.arr);
+    return same;
+}
+
+/* Insertions build the same tree as an AVL tree does, deletions keep the
+ * height within 2 log n.
+ */
+void test_wavl(void)
+{
+    struct bstree *tree = bstree_new_wavl(cmp_int, free_int);
+    struct bstree *avl = bstree_new(cmp_int, free_int);
+    int expected[WAVL_KEYS];
+    int i, j, n, log_n;
+    for (i = 0; i < WAVL_KEYS; i++) {
+        bstree_insert(tree, new_int(i * 7 % WAVL_KEYS));
+        bstree_insert(avl, new_int(i * 7 % WAVL_KEYS));
+    }
+    CHECK(same_shape(tree, avl));
+    CHECK(bstree_height(tree) == bstree_height(avl));
+    /* Take out 9 in 10, leaving the tree sparse */
+    for (i = 0; i < WAVL_KEYS; i++) {
+        n = i * 13 % WAVL_KEYS;
+        if (n % 10) {
+            bstree_remove(tree, &n);
+        }
+    }
+    for (i = 0, j = 0; i < WAVL_KEYS; i += 10) {
+        expected[j++] = i;
+    }
+    CHECK(bstree_size(tree) == j);
+    CHECK(visits(tree, bstree_traverse_inorder, expected, j));
+    for (n = j, log_n = 0; n > 1; n >>= 1) {
+        log_n++;
+    }
+    CHECK(bstree_height(tree) <= 2 * (log_n + 1));
+    n = 500;
+    CHECK(bstree_count(tree, &n) == 1);
+    n = 501;
+    CHECK(bstree_count(tree, &n) == 0);
+    CHECK(*(int *)bstree_min(tree) == 0);
+    CHECK(*(int *)bstree_max(tree) == WAVL_KEYS - 10);
+    /* Keeps working after the deletions */
+    for (i = 1; i < WAVL_KEYS; i += 10) {
+        bstree_insert(tree, new_int(i));
+    }
+    CHECK(bstree_size(tree) == 2 * j);
+    for (i = 0; i < WAVL_KEYS; i++) {
+        bstree_remove(tree, &i);
+    }
+    CHECK(bstree_size(tree) == 0 && bstree_height(tree) == -1);
+    bstree_destroy(tree);
+    bstree_destroy(avl);
+}
+
+#define ASYNC_TREES 8
+#define ASYNC_KEYS 10000
+
+/* Objects freed so far, free_object of async trees runs on another thread */
+static atomic_int async_freed;
+
+void free_counted(void *p)
+{
+    free(p);
+    atomic_fetch_add(&async_freed, 1);
+}
+
+/* Trees destroyed in the background get every object freed, by the time
+ * bstree_reclaim_wait returns.
+ */
+void test_destroy_async(void)
+{
+    struct bstree *trees[ASYNC_TREES];
+    int i, j, n;
+    atomic_store(&async_freed, 0);
+    for (i = 0; i < ASYNC_TREES; i++) {
+        switch (i % 4) {
+        case 0:
+            trees[i] = bstree_new(cmp_int, free_counted);
+            break;
+        case 1:
+            trees[i] = bstree_new_fat(cmp_int, free_counted);
+            break;
+        case 2:
+            trees[i] = bstree_new_wavl(cmp_int, free_counted);
+            break;
+        default:
+            trees[i] = bstree_new_augmented(cmp_int, free_counted,
+                    sizeof(int), sum_leaf, sum_combine);
+        }
+        /* Some of them small, some compacted */
+        n = i < 4 ? ASYNC_KEYS : 3;
+        for (j = 0; j < n; j++) {
+            bstree_insert(trees[i], new_int(j));
+        }
+        if (i == 0) {
+            bstree_compact(trees[i]);
+        }
+    }
+    n = 0;
+    for (i = 0; i < ASYNC_TREES; i++) {
+        n += bstree_size(trees[i]);
+        bstree_destroy_async(trees[i]);
+    }
+    bstree_reclaim_wait();
+    CHECK(atomic_load(&async_freed) == n);
+    CHECK(n == 4 * ASYNC_KEYS + 4 * 3);
+    /* The reclaimer keeps going for trees destroyed later on */
+    trees[0] = bstree_new(cmp_int, free_counted);
+    for (j = 0; j < ASYNC_KEYS; j++) {
+        bstree_insert(trees[0], new_int(j));
+    }
+    bstree_destroy_async(trees[0]);
+    bstree_reclaim_wait();
+    CHECK(atomic_load(&async_freed) == n + ASYNC_KEYS);
+}
+
+#define COMPACT_KEYS 2000
+
+unsigned long hash_int(const void *p)
+{
+    return (unsigned long)*(const int *)p * 2654435761UL;
+}
+
+/* Compacting moves every node, which must not change anything else: not
+ * the contents, nor the fingers, the hash index or the aggregates.
+ */
+void test_compact(struct bstree *tree, int augmented)
+{
+    int expected[COMPACT_KEYS];
+    int i, j, n, sum, lo = 0, hi = COMPACT_KEYS;
+    for (i = 0; i < COMPACT_KEYS; i++) {
+        bstree_insert(tree, new_int(i * 7 % COMPACT_KEYS));
+    }
+    bstree_insert(tree, new_int(8));
+    /* Churn, so that the nodes are scattered */
+    for (i = 0; i < COMPACT_KEYS; i += 2) {
+        bstree_remove(tree, &i);
+    }
+    /* What this gives back is the allocator's overhead per node, which
+     * depends on the allocator, so it is not checked.
+     */
+    bstree_compact(tree);
+    for (i = 1, j = 0; i < COMPACT_KEYS; i += 2) {
+        expected[j++] = i;
+    }
+    CHECK(visits(tree, bstree_traverse_inorder, expected, j));
+    CHECK(bstree_size(tree) == j);
+    CHECK(*(int *)bstree_min(tree) == 1);
+    CHECK(*(int *)bstree_max(tree) == COMPACT_KEYS - 1);
+    n = 7;
+    CHECK(bstree_count(tree, &n) == 1 && *(int *)bstree_search(tree, &n) == 7);
+    n = 8;
+    CHECK(bstree_count(tree, &n) == 0 && bstree_search(tree, &n) == NULL);
+    sum = 0;
+    CHECK(bstree_range_aggregate(tree, &lo, &hi, &sum) == augmented);
+    CHECK(sum == (augmented ? j * j : 0));
+    if (augmented) {
+        /* The odd keys from 101 to 199, then 7 alone */
+        lo = 100;
+        hi = 200;
+        sum = 0;
+        CHECK(bstree_range_aggregate(tree, &lo, &hi, &sum));
+        CHECK(sum == 50 * 150);
+        lo = hi = 7;
+        sum = 0;
+        CHECK(bstree_range_aggregate(tree, &lo, &hi, &sum) && sum == 7);
+        /* Only the removed 8 in between */
+        lo = hi = 8;
+        sum = -1;
+        CHECK(!bstree_range_aggregate(tree, &lo, &hi, &sum) && sum == -1);
+        lo = 9;
+        hi = 3;
+        CHECK(!bstree_range_aggregate(tree, &lo, &hi, &sum) && sum == -1);
+        lo = 0;
+        hi = COMPACT_KEYS;
+    }
+    /* Nodes in the compacted block are freed and reused as any other */
+    for (i = 1; i < COMPACT_KEYS; i += 4) {
+        bstree_remove(tree, &i);
+    }
+    for (i = 0; i < COMPACT_KEYS; i += 2) {
+        bstree_insert(tree, new_int(i));
+    }
+    for (i = 0, j = 0; i < COMPACT_KEYS; i++) {
+        if (i % 4 != 1) {
+            expected[j++] = i;
+        }
+    }
+    CHECK(visits(tree, bstree_traverse_inorder, expected, j));
+    /* Compacting twice is fine */
+    bstree_compact(tree);
+    CHECK(visits(tree, bstree_traverse_inorder, expected, j));
+    sum = 0;
+    CHECK(bstree_range_aggregate(tree, &lo, &hi, &sum) == augmented);
+    for (i = 0; augmented && i < j; i++) {
+        sum -= expected[i];
+    }
+    CHECK(sum == 0);
+    bstree_destroy(tree);
+}
+
+#define APPEND_KEYS 1000
+
+/* Rebuild the binary tree from its preorder, which only one search tree
+ * of distinct objects has, and return its height, or -2 if that is not a
+ * search tree or one of its nodes is not AVL balanced.
+ */
+int avl_height(const int *pre, int n)
+{
+    int i, j, lhs, rhs;
+    if (n == 0) {
+        return -1;
+    }
+    for (i = 1; i < n && pre[i] < pre[0]; i++) {
+    }
+    for (j = i; j < n; j++) {
+        if (pre[j] <= pre[0]) {
+            return -2;
+        }
+    }
+    lhs = avl_height(pre + 1, i - 1);
+    rhs = avl_height(pre + i, n - i);
+    if (lhs == -2 || rhs == -2 || lhs - rhs > 1 || rhs - lhs > 1) {
+        return -2;
+    }
+    return (lhs > rhs ? lhs : rhs) + 1;
+}
+
+/* Return whether the tree is an AVL tree as tall as it says it is.
+ */
+int is_avl(struct bstree *tree)
+{
+    struct int_arr elements = { malloc(sizeof(int)), -1, 1 };
+    int height;
+    bstree_traverse_preorder(tree, &elements, mk_array);
+    height = avl_height(elements.arr, elements.last + 1);
+    free(elements.arr);
+    return height != -2 && height == bstree_height(tree);
+}
+
+/* Appending runs that go up must build the same valid tree as inserting
+ * them, keep the fingers, the hash index and the aggregates right, and
+ * anything else must fall back to bstree_insert. Fat trees are not binary,
+ * so only their contents are checked.
+ */
+void test_append(struct bstree *tree, int binary, int augmented)
+{
+    int expected[APPEND_KEYS + 4];
+    int i, j, n, sum, want, lo, hi;
+    for (i = 0; i < APPEND_KEYS; i++) {
+        bstree_append(tree, new_int(2 * i));
+        if (i < 8 || i % 100 == 0) {
+            CHECK(*(int *)bstree_min(tree) == 0 &&
+                    *(int *)bstree_max(tree) == 2 * i);
+        }
+        expected[i] = 2 * i;
+    }
+    CHECK(visits(tree, bstree_traverse_inorder, expected, APPEND_KEYS));
+    CHECK(bstree_size(tree) == APPEND_KEYS);
+    CHECK(!binary || is_avl(tree));
+    /* The greatest once more is counted */
+    bstree_append(tree, new_int(2 * (APPEND_KEYS - 1)));
+    n = 2 * (APPEND_KEYS - 1);
+    CHECK(bstree_count(tree, &n) == 2);
+    CHECK(bstree_size(tree) == APPEND_KEYS);
+    CHECK(*(int *)bstree_max(tree) == n);
+    /* Less than the greatest, inserted where they go */
+    bstree_append(tree, new_int(501));
+    bstree_append(tree, new_int(1));
+    bstree_append(tree, new_int(-1));
+    bstree_append(tree, new_int(2 * APPEND_KEYS + 1));
+    for (i = 0, j = 0; i < APPEND_KEYS; i++) {
+        if (i == 0) {
+            expected[j++] = -1;
+        }
+        expected[j++] = 2 * i;
+        if (i == 0) {
+            expected[j++] = 1;
+        } else if (i == 250) {
+            expected[j++] = 501;
+        }
+    }
+    expected[j++] = 2 * APPEND_KEYS + 1;
+    CHECK(visits(tree, bstree_traverse_inorder, expected, j));
+    CHECK(bstree_size(tree) == APPEND_KEYS + 4);
+    CHECK(*(int *)bstree_min(tree) == -1);
+    CHECK(*(int *)bstree_max(tree) == 2 * APPEND_KEYS + 1);
+    CHECK(!binary || is_avl(tree));
+    for (i = 0; i < j; i++) {
+        CHECK(bstree_search(tree, &expected[i]) &&
+                *(int *)bstree_search(tree, &expected[i]) == expected[i]);
+    }
+    n = 3;
+    CHECK(bstree_search(tree, &n) == NULL && bstree_count(tree, &n) == 0);
+    if (augmented) {
+        for (lo = -2; lo <= 2 * APPEND_KEYS + 2; lo += 97) {
+            hi = lo + 3 * lo % 701;
+            want = 0;
+            n = 0;
+            for (i = 0; i < j; i++) {
+                if (expected[i] >= lo && expected[i] <= hi) {
+                    want += expected[i];
+                    n++;
+                }
+            }
+            /* The greatest one has a count of 2 */
+            if (2 * (APPEND_KEYS - 1) >= lo && 2 * (APPEND_KEYS - 1) <= hi) {
+                want += 2 * (APPEND_KEYS - 1);
+            }
+            sum = 0;
+            CHECK(bstree_range_aggregate(tree, &lo, &hi, &sum) == (n != 0));
+            CHECK(sum == want);
+        }
+    }
+    bstree_destroy(tree);
+}
+
+#define HASHED_KEYS 256
+#define HASHED_OPS 20000
+
+/* 32 keys to a hash, so that they share long probe runs */
+unsigned long hash_coarse(const void *p)
+{
+    return (unsigned long)(*(const int *)p / 32);
+}
+
+/* Return whether the tree holds exactly what the model says: objects[k]
+ * with a count of counts[k] for every key k, found through the index.
+ */
+int hashed_agrees(struct bstree *tree, int **objects, const int *counts)
+{
+    int k;
+    for (k = -1; k <= HASHED_KEYS; k++) {
+        if (k < 0 || k == HASHED_KEYS) {
+            if (bstree_search(tree, &k) || bstree_count(tree, &k)) {
+                return 0;
+            }
+        } else if (bstree_search(tree, &k) != objects[k] ||
+                bstree_count(tree, &k) != counts[k]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Random updates of every kind on a hashed tree, each followed by a
+ * search of every key, checked against a plain array of the keys.
+ */
+void test_hashed(unsigned long (*hash_object)(const void *object))
+{
+    struct bstree *tree = bstree_new_hashed(cmp_int, hash_object, free_int);
+    int *objects[HASHED_KEYS] = { NULL };
+    int counts[HASHED_KEYS] = { 0 };
+    int i, k, m, removed, agrees = 1;
+    int *p;
+    for (i = 0; agrees && i < HASHED_OPS; i++) {
+        k = rand() % HASHED_KEYS;
+        switch (rand() % 7) {
+            case 0:
+            case 1:
+                p = new_int(k);
+                if (i % 2) {
+                    bstree_insert(tree, p);
+                } else {
+                    bstree_append(tree, p);
+                }
+                if (!counts[k]++) {
+                    objects[k] = p;
+                }
+                break;
+            case 2:
+                p = new_int(k);
+                bstree_replace(tree, p);
+                objects[k] = p;
+                counts[k] += !counts[k];
+                break;
+            case 3:
+                bstree_remove(tree, &k);
+                objects[k] = NULL;
+                counts[k] = 0;
+                break;
+            case 4:
+                p = objects[k];
+                bstree_release(tree, &k);
+                free(p);
+                objects[k] = NULL;
+                counts[k] = 0;
+                break;
+            default:
+                for (m = 0; m < HASHED_KEYS && !counts[m]; m++) {
+                }
+                if (i % 2) {
+                    for (m = HASHED_KEYS - 1; m >= 0 && !counts[m]; m--) {
+                    }
+                }
+                p = i % 2 ? bstree_pop_max(tree, &removed)
+                    : bstree_pop_min(tree, &removed);
+                if (m < 0 || m == HASHED_KEYS) {
+                    agrees = p == NULL && !removed;
+                    break;
+                }
+                agrees = p == objects[m] && removed == (counts[m] == 1);
+                if (!--counts[m]) {
+                    objects[m] = NULL;
+                    free(p);
+                }
+        }
+        agrees = agrees && hashed_agrees(tree, objects, counts);
+    }
+    CHECK(agrees);
+    /* Fill in every key, then empty whole probe runs but for their ends */
+    for (k = 0; k < HASHED_KEYS; k++) {
+        if (!counts[k]++) {
+            objects[k] = new_int(k);
+            bstree_append(tree, objects[k]);
+        } else {
+            bstree_insert(tree, new_int(k));
+        }
+    }
+    CHECK(hashed_agrees(tree, objects, counts));
+    for (k = 1; k < HASHED_KEYS - 1; k++) {
+        if (k % 64 != 0) {
+            bstree_remove(tree, &k);
+            objects[k] = NULL;
+            counts[k] = 0;
+        }
+    }
+    CHECK(hashed_agrees(tree, objects, counts));
+    CHECK(is_avl(tree));
+    /* And fill them in again */
+    for (k = 0; k < HASHED_KEYS; k++) {
+        if (!counts[k]) {
+            objects[k] = new_int(k);
+            counts[k] = 1;
+            bstree_insert(tree, objects[k]);
+        }
+    }
+    CHECK(hashed_agrees(tree, objects, counts));
+    bstree_destroy(tree);
+}
+
+const char *str_key(const void *object)
+{
+    return object;
+}
+
+int cmp_str(const void *lhs, const void *rhs)
+{
+    return strcmp(*(char *const *)lhs, *(char *const *)rhs);
+}
+
+int collect_str(void *ptr, void *it_data)
+{
+    const char ***at = it_data;
+    *(*at)++ = ptr;
+    return 0;
+}
+
+/* String trees cache the first 8 bytes and the length of each key, they
+ * must still order keys the way strcmp does, bytes being unsigned.
+ */
+void test_str(void)
+{
+    const char *words[] = {
+        "", "a", "ab", "abc", "abcdefgh", "abcdefghi", "abcdefgg",
+        "prefix__alpha", "prefix__beta", "prefix__", "prefix_", "zebra",
+        "\xc3\xa9t\xc3\xa9", "\x7f", "mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm",
+        "mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm", "b", "ba", "abcdefgh\x80"
+    };
+    const int n_words = sizeof words / sizeof *words;
+    const char *sorted[sizeof words / sizeof *words];
+    const char *seen[sizeof words / sizeof *words];
+    const char **at = seen;
+    struct bstree *tree = bstree_new_str(str_key, free);
+    int i, same;
+    char *p;
+    for (i = 0; i < n_words; i++) {
+        bstree_insert(tree, strdup(words[i]));
+        sorted[i] = words[i];
+    }
+    bstree_insert(tree, strdup("prefix__beta"));
+    qsort(sorted, n_words, sizeof *sorted, cmp_str);
+    CHECK(bstree_size(tree) == n_words);
+    bstree_traverse_inorder(tree, &at, collect_str);
+    same = at - seen == n_words;
+    for (i = 0; same && i < n_words; i++) {
+        same = strcmp(seen[i], sorted[i]) == 0;
+    }
+    CHECK(same);
+    CHECK(bstree_count(tree, "prefix__beta") == 2);
+    CHECK(bstree_count(tree, "prefix__gamma") == 0);
+    CHECK(bstree_count(tree, "abcdefg") == 0);
+    p = bstree_search(tree, "abcdefghi");
+    CHECK(p && strcmp(p, "abcdefghi") == 0);
+    CHECK(strcmp(bstree_min(tree), "") == 0);
+    CHECK(strcmp(bstree_max(tree), "\xc3\xa9t\xc3\xa9") == 0);
+    bstree_remove(tree, "abcdefgh");
+    bstree_remove(tree, "prefix__");
+    bstree_remove(tree, "not there");
+    CHECK(bstree_size(tree) == n_words - 2);
+    CHECK(bstree_count(tree, "abcdefgh") == 0);
+    CHECK(bstree_count(tree, "abcdefghi") == 1);
+    CHECK(bstree_count(tree, "prefix__alpha") == 1);
+    /* The key of a replaced object is the new one's */
+    bstree_replace(tree, strdup("zebra"));
+    CHECK(bstree_count(tree, "zebra") == 1);
+    p = bstree_pop_min(tree, NULL);
+    CHECK(strcmp(p, "") == 0);
+    free(p);
+    bstree_destroy(tree);
+}
+
+void test_bounded(void)
+{
+    struct bstree *tree;
+    const int top[] = { 4, 5, 6 };
+    int i;
+    int *p, *q;
+    errno = 0;
+    CHECK(bstree_new_bounded(cmp_int, free_int, 0) == NULL &&
+            errno == EINVAL);
+    CHECK(bstree_new_bounded(cmp_int, free_int, -1) == NULL);
+    tree = bstree_new_bounded(cmp_int, free_int, 3);
+    for (i = 1; i <= 3; i++) {
+        CHECK(bstree_insert_evict(tree, new_int(i)) == NULL);
+    }
+    /* The least one makes room */
+    p = bstree_insert_evict(tree, new_int(4));
+    CHECK(p && *p == 1);
+    free(p);
+    /* Less than everything in a full tree, turned away */
+    q = new_int(0);
+    CHECK(bstree_insert_evict(tree, q) == q);
+    free(q);
+    bstree_insert(tree, new_int(5));
+    bstree_insert(tree, new_int(6));
+    bstree_insert(tree, new_int(2));
+    CHECK(bstree_size(tree) == 3);
+    CHECK(visits(tree, bstree_traverse_inorder, top, 3));
+    bstree_destroy(tree);
+}
+
+size_t encode_int(const void *object, void *buf, size_t cap)
+{
+    if (cap >= sizeof(int)) {
+        memcpy(buf, object, sizeof(int));
+    }
+    return sizeof(int);
+}
+
+void *decode_int(const void *buf, size_t len)
+{
+    int *p = malloc(sizeof *p);
+    if (len != sizeof *p) {
+        free(p);
+        return NULL;
+    }
+    memcpy(p, buf, sizeof *p);
+    return p;
+}
+
+struct bstree *reopen(struct bstree *(*new)(
+            int (*compare_object)(const void *lhs, const void *rhs),
+            void (*free_object)(void *object)),
+        const char *path)
+{
+    struct bstree *tree = new(cmp_int, free_int);
+    CHECK(bstree_wal_open(tree, path, encode_int, decode_int) == 0);
+    return tree;
+}
+
+/* Log a tree, and read it back from the log, then from a checkpoint.
+ */
+void test_wal(struct bstree *(*new)(
+            int (*compare_object)(const void *lhs, const void *rhs),
+            void (*free_object)(void *object)))
+{
+    char path[] = "/tmp/bstree_test_XXXXXX";
+    char tmp_path[sizeof path + 4];
+    struct bstree *tree;
+    /* 2 to 39, without 10, 11 and 33, with two counts of 5 and 50 */
+    int expected[40];
+    int i, j, n;
+    int *p;
+    close(mkstemp(path));
+    unlink(path);
+    tree = reopen(new, path);
+    CHECK(bstree_size(tree) == 0);
+    for (i = 1; i <= 40; i++) {
+        bstree_insert(tree, new_int(i));
+    }
+    bstree_insert(tree, new_int(5));
+    bstree_replace(tree, new_int(7));
+    n = 10;
+    bstree_remove(tree, &n);
+    n = 11;
+    p = bstree_search(tree, &n);
+    bstree_release(tree, &n);
+    free(p);
+    free(bstree_pop_min(tree, NULL));
+    free(bstree_pop_max(tree, NULL));
+    /* Folded into a single object with a count of 2 */
+    bstree_insert(tree, new_int(50));
+    n = 50;
+    bstree_remove(tree, &n);
+    bstree_insert(tree, new_int(50));
+    bstree_insert(tree, new_int(50));
+    CHECK(bstree_wal_sync(tree) == 0);
+    bstree_destroy(tree);
+    for (i = 2, j = 0; i <= 39; i++) {
+        if (i != 10 && i != 11 && i != 33) {
+            expected[j++] = i;
+        }
+        if (i == 5) {
+            expected[j++] = i;
+        }
+    }
+    expected[j++] = 50;
+    expected[j++] = 50;
+    /* Replay */
+    tree = reopen(new, path);
+    n = 33;
+    bstree_remove(tree, &n);
+    CHECK(visits(tree, bstree_traverse_inorder_cnt, expected, j));
+    CHECK(bstree_size(tree) == j - 2);
+    CHECK(*(int *)bstree_min(tree) == 2 && *(int *)bstree_max(tree) == 50);
+    /* Checkpoint, then log more on top of it */
+    CHECK(bstree_wal_checkpoint(tree) == 0);
+    bstree_insert(tree, new_int(60));
+    expected[j++] = 60;
+    CHECK(bstree_wal_close(tree) == 0);
+    /* Not logged anymore */
+    bstree_insert(tree, new_int(70));
+    /* Nor can a log be opened on a tree that holds something */
+    errno = 0;
+    CHECK(bstree_wal_open(tree, path, encode_int, decode_int) == -1 &&
+            errno == EINVAL);
+    CHECK(bstree_size(tree) == j - 1);
+    bstree_destroy(tree);
+    /* Or on a tree that is logged already */
+    tree = reopen(new, path);
+    errno = 0;
+    CHECK(bstree_wal_open(tree, path, encode_int, decode_int) == -1 &&
+            errno == EINVAL);
+    CHECK(bstree_wal_close(tree) == 0);
+    bstree_destroy(tree);
+    tree = reopen(new, path);
+    CHECK(visits(tree, bstree_traverse_inorder_cnt, expected, j));
+    bstree_destroy(tree);
+    /* If the log cannot be checkpointed, the tree is left empty */
+    sprintf(tmp_path, "%s.tmp", path);
+    mkdir(tmp_path, 0700);
+    tree = new(cmp_int, free_int);
+    CHECK(bstree_wal_open(tree, path, encode_int, decode_int) == -1 &&
+            errno == EISDIR);
+    CHECK(bstree_size(tree) == 0 && bstree_min(tree) == NULL);
+    bstree_insert(tree, new_int(1));
+    CHECK(bstree_size(tree) == 1);
+    bstree_destroy(tree);
+    rmdir(tmp_path);
+    /* Nor is anything that is not a log read */
+    n = open(path, O_WRONLY | O_TRUNC);
+    CHECK(write(n, "garbage", 7) == 7);
+    close(n);
+    tree = new(cmp_int, free_int);
+    CHECK(bstree_wal_open(tree, path, encode_int, decode_int) == -1 &&
+            errno == EINVAL);
+    CHECK(bstree_size(tree) == 0);
+    bstree_destroy(tree);
+    unlink(path);
+}
+
+/* Refuses 13, as if it were written by a newer version */
+void *decode_not_13(const void *buf, size_t len)
+{
+    int *p = decode_int(buf, len);
+    if (p && *p == 13) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* Read at most 'cap' bytes of the file into buf, returns how many.
+ */
+ssize_t slurp(const char *path, char *buf, size_t cap)
+{
+    int fd = open(path, O_RDONLY);
+    ssize_t n = read(fd, buf, cap);
+    close(fd);
+    return n;
+}
+
+/* Flip a bit of the byte at 'offset' from the end of the file.
+ */
+void flip(const char *path, off_t offset)
+{
+    int fd = open(path, O_RDWR);
+    off_t at = lseek(fd, -offset, SEEK_END);
+    char c;
+    CHECK(pread(fd, &c, 1, at) == 1);
+    c ^= 1;
+    CHECK(pwrite(fd, &c, 1, at) == 1);
+    close(fd);
+}
+
+/* Only the end of a log can be torn, anything wrong before that fails the
+ * open and leaves the log alone. Every record here is an inserted int:
+ * the op, its length, 4 bytes and 4 of checksum.
+ */
+void test_wal_corrupt(void)
+{
+    char path[] = "/tmp/bstree_test_XXXXXX";
+    char before[4096], after[4096];
+    const int zeros[16] = { 0 };
+    int expected[20];
+    struct bstree *tree;
+    ssize_t len;
+    int i, fd;
+    close(mkstemp(path));
+    unlink(path);
+    tree = reopen(bstree_new, path);
+    for (i = 1; i <= 20; i++) {
+        bstree_insert(tree, new_int(i));
+        expected[i - 1] = i;
+    }
+    CHECK(bstree_wal_close(tree) == 0);
+    bstree_destroy(tree);
+    len = slurp(path, before, sizeof before);
+    /* A record that checks out but cannot be decoded */
+    tree = bstree_new(cmp_int, free_int);
+    errno = 0;
+    CHECK(bstree_wal_open(tree, path, encode_int, decode_not_13) == -1 &&
+            errno == EILSEQ);
+    CHECK(bstree_size(tree) == 0);
+    bstree_destroy(tree);
+    CHECK(slurp(path, after, sizeof after) == len &&
+            memcmp(before, after, len) == 0);
+    /* A record whose checksum fails, with more after it */
+    flip(path, 8 * 10 - 3);
+    tree = bstree_new(cmp_int, free_int);
+    errno = 0;
+    CHECK(bstree_wal_open(tree, path, encode_int, decode_int) == -1 &&
+            errno == EILSEQ);
+    CHECK(bstree_size(tree) == 0);
+    bstree_destroy(tree);
+    flip(path, 8 * 10 - 3);
+    /* The last one torn, and zeros after it, lose that record only */
+    flip(path, 10 - 3);
+    fd = open(path, O_WRONLY | O_APPEND);
+    CHECK(write(fd, zeros, sizeof zeros) == sizeof zeros);
+    close(fd);
+    tree = reopen(bstree_new, path);
+    CHECK(visits(tree, bstree_traverse_inorder, expected, 19));
+    bstree_destroy(tree);
+    unlink(path);
+}
+
 int main(void)
 {
     struct bstree *tree = bstree_new(cmp_int, free_int);
     int *arr[ARR_SIZE];
-    int i, sum;
+    struct bstree *sums = bstree_new_augmented(cmp_int, free_int, sizeof(int),
+            sum_leaf, sum_combine);
+    /* Keeps the 3 greatest values inserted */
+    struct bstree *top = bstree_new_bounded(cmp_int, free_int, 3);
+    int i, sum, want, removed, lo = 3, hi = 6, single;
+    /* How many times each value is inserted */
+    int seen[10] = { 0 };
+    int *p;
+    void *chunk[CHUNK_SIZE];
+    int counts[CHUNK_SIZE];
     struct int_arr elements = { malloc(sizeof(int)), -1, 1 };
     for (i = 0; i < ARR_SIZE; i++) {
         arr[i] = malloc(sizeof(int));
         *arr[i] = rand() % 10;
+        seen[*arr[i]]++;
         printf("*arr[%d] = %d\n", i, *arr[i]);
     }
     putchar('\n');
     for (i = 0; i < ARR_SIZE; i++) {
+        p = malloc(sizeof *p);
+        *p = *arr[i];
+        bstree_insert(sums, p);
+        p = malloc(sizeof *p);
+        *p = *arr[i];
+        bstree_insert(top, p);
         bstree_insert(tree, arr[i]);
         arr[i] = NULL;
     }
@@ -113,6 +1174,31 @@ int main(void)
     bstree_traverse_inorder(tree, &sum, sum_int);
     printf("\nsum = %d\n", sum);
     sum = 0;
+    bstree_traverse_chunks(tree, BSTREE_INORDER, chunk, counts, CHUNK_SIZE,
+            &sum, sum_int_chunk);
+    printf("\nsum with counts = %d\n", sum);
+    sum = 0;
+    want = 0;
+    for (i = lo; i <= hi; i++) {
+        want += i * seen[i];
+    }
+    CHECK(bstree_range_aggregate(sums, &lo, &hi, &sum) == (want != 0));
+    CHECK(sum == want);
+    printf("\nsum of [%d, %d] = %d\n", lo, hi, sum);
+    /* A single key, with its count */
+    single = *(int *)bstree_max(sums);
+    sum = 0;
+    CHECK(bstree_range_aggregate(sums, &single, &single, &sum));
+    CHECK(sum == single * seen[single]);
+    /* Nothing in the range, or no range at all, leaves sum as it is */
+    lo = 10;
+    hi = 20;
+    sum = -1;
+    CHECK(!bstree_range_aggregate(sums, &lo, &hi, &sum) && sum == -1);
+    lo = 6;
+    hi = 3;
+    CHECK(!bstree_range_aggregate(sums, &lo, &hi, &sum) && sum == -1);
+    sum = 0;
     bstree_traverse_inorder(tree, &sum, sum_int_lt_5);
     printf("\nsum lt 10 = %d\n", sum);
     /* Fill elements in an array */
@@ -152,7 +1238,7 @@ int main(void)
     printf("Removed from [0, 100)\n");
     printf("height: %d\n", bstree_height(tree));
     bstree_traverse_inorder(tree, NULL, print_int);
-    int *p = malloc(sizeof *p);
+    p = malloc(sizeof *p);
     *p = 7;
     bstree_insert(tree, p);
     p = NULL;
@@ -163,6 +1249,58 @@ int main(void)
     bstree_release(tree, &n);
     printf("found %d\n", *p);
     free(p);
+    /* Drain the tree from both ends, like a priority queue */
+    for (i = 0; i < ARR_SIZE; i++) {
+        p = malloc(sizeof *p);
+        *p = i % 5;
+        bstree_insert(tree, p);
+    }
+    printf("min = %d, max = %d\n", *(int *)bstree_min(tree),
+            *(int *)bstree_max(tree));
+    for (i = 0, n = 0; (p = i % 2 ? bstree_pop_max(tree, &removed)
+                : bstree_pop_min(tree, &removed)); i++) {
+        printf("popped %d\n", *p);
+        /* Ours once its last count is gone */
+        if (removed) {
+            CHECK(bstree_count(tree, p) == 0);
+            free(p);
+            n++;
+        }
+    }
+    CHECK(i == ARR_SIZE && n == 5 && bstree_size(tree) == 0);
+    puts("top 3:");
+    bstree_traverse_inorder(top, NULL, print_int);
     bstree_destroy(tree);
-    return 0;
+    bstree_destroy(sums);
+    bstree_destroy(top);
+    test_small(bstree_new);
+    test_small(bstree_new_wavl);
+    test_remove_rebalance();
+    test_remove_count();
+    test_fat();
+    test_wavl();
+    test_destroy_async();
+    test_compact(bstree_new(cmp_int, free_int), 0);
+    test_compact(bstree_new_wavl(cmp_int, free_int), 0);
+    test_compact(bstree_new_hashed(cmp_int, hash_int, free_int), 0);
+    test_compact(bstree_new_augmented(cmp_int, free_int, sizeof(int),
+                sum_leaf, sum_combine), 1);
+    test_append(bstree_new(cmp_int, free_int), 1, 0);
+    test_append(bstree_new_wavl(cmp_int, free_int), 1, 0);
+    test_append(bstree_new_fat(cmp_int, free_int), 0, 0);
+    test_append(bstree_new_hashed(cmp_int, hash_int, free_int), 1, 0);
+    test_append(bstree_new_augmented(cmp_int, free_int, sizeof(int),
+                sum_leaf, sum_combine), 1, 1);
+    test_hashed(hash_int);
+    test_hashed(hash_coarse);
+    test_str();
+    test_bounded();
+    test_wal(bstree_new);
+    test_wal(bstree_new_fat);
+    test_wal(bstree_new_wavl);
+    test_wal_corrupt();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+    }
+    return failures != 0;
 }
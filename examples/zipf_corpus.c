@@ -0,0 +1,203 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Write a synthetic corpus for the markov benchmark to the standard output.
+ * Word frequencies follow Zipf's law over a vocabulary of the given size.
+ * The generator does not depend on the C library's rand(), and integer
+ * exponents (the default is 1) do not depend on its pow() either, so a
+ * seed gives the same corpus wherever doubles are IEEE doubles. Other
+ * exponents give the same corpus with the same libm.
+ * Usage: ./zipf_corpus.out -v vocabulary -n tokens [-a exponent] [-s seed]
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define VOCABULARY 100000
+#define TOKENS 1000000
+#define WORDS_PER_LINE 16
+/* Longest word, 26^14 is past any unsigned long rank */
+#define MAX_WORD_LEN 16
+/* Greater integer exponents are left to pow(), any rank past the first
+ * has no weight to speak of then.
+ */
+#define MAX_INT_EXPONENT 64
+
+struct cli_opts {
+    unsigned long vocabulary;
+    unsigned long tokens;
+    double exponent;
+    unsigned long long seed;
+};
+
+/* splitmix64 */
+static unsigned long long next_rnd(unsigned long long *state)
+{
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double uniform_rnd(unsigned long long *state)
+{
+    return (next_rnd(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* 1 / (rank + 1)^exponent. Integer exponents are done with multiplications,
+ * which round the same everywhere, unlike pow().
+ */
+static double weight(unsigned long rank, double exponent)
+{
+    double base = (double)(rank + 1), power = 1;
+    int i;
+    if (exponent > MAX_INT_EXPONENT || exponent != (int)exponent) {
+        return pow(base, -exponent);
+    }
+    for (i = 0; i < (int)exponent; i++) {
+        power *= base;
+    }
+    return 1 / power;
+}
+
+/* cdf[i] is the total weight of the ranks up to i.
+ */
+static double *mkcdf(unsigned long n, double exponent)
+{
+    double *cdf = malloc(n * sizeof *cdf);
+    double sum = 0;
+    unsigned long i;
+    for (i = 0; i < n; i++) {
+        sum += weight(i, exponent);
+        cdf[i] = sum;
+    }
+    return cdf;
+}
+
+/* Return the first rank whose cumulative weight exceeds u * total.
+ */
+static unsigned long sample(const double *cdf, unsigned long n, double u)
+{
+    double target = u * cdf[n - 1];
+    unsigned long lo = 0, hi = n - 1, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (cdf[mid] > target) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+/* Spell the rank in bijective base 26: a, b, ..., z, aa, ab, ... so the
+ * frequent words are the short ones, as in natural text. The most frequent
+ * word is "a". Returns the length.
+ */
+static int spell(unsigned long rank, char *buf)
+{
+    char tmp[MAX_WORD_LEN];
+    int len = 0, i;
+    rank++;
+    while (rank) {
+        rank--;
+        tmp[len++] = 'a' + rank % 26;
+        rank /= 26;
+    }
+    for (i = 0; i < len; i++) {
+        buf[i] = tmp[len - 1 - i];
+    }
+    return len;
+}
+
+static void print_usage(char **argv)
+{
+    fprintf(stderr, "Usage: %s [-v vocabulary] [-n tokens] [-a exponent]"
+            " [-s seed]\n", argv[0]);
+    fprintf(stderr, "-v\t\tNumber of distinct words, default is %d\n",
+            VOCABULARY);
+    fprintf(stderr, "-n\t\tNumber of words to write, default is %d\n",
+            TOKENS);
+    fprintf(stderr, "-a\t\tExponent of the Zipf distribution, default is 1\n");
+    fprintf(stderr, "-s\t\tSeed of the generator, default is 1\n");
+}
+
+/* Parse the command line options and place them in opts.
+ * Returns 0 on succes, nonzero on failure.
+ */
+static int parse_opts(int argc, char **argv, struct cli_opts *opts)
+{
+    int opt;
+    char *end;
+    opts->vocabulary = VOCABULARY;
+    opts->tokens = TOKENS;
+    opts->exponent = 1.0;
+    opts->seed = 1;
+    while ((opt = getopt(argc, argv, "v:n:a:s:")) != -1) {
+        errno = 0;
+        switch (opt) {
+            case 'v':
+                opts->vocabulary = strtoul(optarg, &end, 10);
+                break;
+            case 'n':
+                opts->tokens = strtoul(optarg, &end, 10);
+                break;
+            case 'a':
+                opts->exponent = strtod(optarg, &end);
+                break;
+            case 's':
+                opts->seed = strtoull(optarg, &end, 10);
+                break;
+            default:
+                return 1;
+        }
+        if (errno || *end || end == optarg) {
+            return 1;
+        }
+    }
+    return opts->vocabulary == 0 || opts->exponent < 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct cli_opts opts;
+    unsigned long long state;
+    unsigned long i;
+    double *cdf;
+    char buf[MAX_WORD_LEN + 1];
+    int len;
+    if (parse_opts(argc, argv, &opts)) {
+        print_usage(argv);
+        return 1;
+    }
+    state = opts.seed;
+    cdf = mkcdf(opts.vocabulary, opts.exponent);
+    for (i = 0; i < opts.tokens; i++) {
+        len = spell(sample(cdf, opts.vocabulary, uniform_rnd(&state)), buf);
+        buf[len++] = (i + 1) % WORDS_PER_LINE && i + 1 < opts.tokens
+            ? ' ' : '\n';
+        fwrite(buf, 1, len, stdout);
+    }
+    free(cdf);
+    return 0;
+}